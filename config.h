@@ -0,0 +1,11 @@
+#define _GNU_SOURCE
+#include <curses.h>
+#include <term.h>
+#include <stdlib.h>
+#define HAVE_REALLOCARRAY	1
+#define HAVE_SCHED_GETAFFINITY	1
+#define HAVE_ZLIB	1
+#define __dead __attribute__((__noreturn__))
+#define __multiversion	__attribute__((target_clones("avx2", "sse4.2", "default")))
+int pledge(const char *, const char *);
+long long strtonum(const char *, long long, long long, const char **);
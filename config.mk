@@ -0,0 +1,16 @@
+CC=		cc
+CFLAGS=		-Werror -Wpedantic -Wshadow -Wformat-signedness -g -O2 -Wall -Wextra -MD -MP -pthread
+CPPFLAGS=	-I${.CURDIR}
+DEBUG=		-g -O2
+LDFLAGS=	-lcurses -pthread -lz
+
+FUZZ=		
+LTO=		-flto
+PGOGEN=		-fprofile-generate=${.OBJDIR}/pgo -fprofile-update=atomic
+PGOMERGE=	:
+PGOUSE=		-fprofile-use=${.OBJDIR}/pgo -Wno-missing-profile
+
+BINDIR?=	/usr/local/bin
+MANDIR?=	/usr/local/man
+INSTALL?=	install
+INSTALL_MAN?=	${INSTALL}
@@ -0,0 +1,946 @@
+/*
+ * Differential fuzzing harness. The matcher and the key decoder of pick are fed
+ * arbitrary input and the outcome is compared against straightforward reference
+ * implementations, aborting on any difference.
+ *
+ * Linked with libFuzzer, LLVMFuzzerTestOneInput() is the entry point. Otherwise
+ * a standalone driver is used, capable of generating input as well as
+ * replaying, minimizing and benchmarking a corpus, see fuzz_usage().
+ */
+
+/* Lowered for the parallel scan and sort to be reached by small input. */
+#define SCAN_MIN	8
+#define SORT_MIN	4
+
+#define main	pick_main
+#include "pick.c"
+#undef main
+
+#include <dirent.h>
+#include <stdarg.h>
+
+#ifndef nitems
+#define nitems(a)	(sizeof(a) / sizeof((a)[0]))
+#endif
+
+#define FUZZ_MAX	4096	/* input size limit, the references are slow */
+#define FUZZ_PAD	16	/* bytes following the key decoder input */
+
+/* Only ASCII is folded bytewise, see strcaseprefix(). */
+#define REF_FOLD(c)	((c) >= 'A' && (c) <= 'Z' ? (c) - 'A' + 'a' : (c))
+
+struct outcome {
+	size_t		 index;
+	ssize_t		 start;
+	ssize_t		 end;
+	double		 score;
+};
+
+struct refkey {
+	enum key	 key;
+	const char	*str;
+};
+
+int			 LLVMFuzzerTestOneInput(const uint8_t *, size_t);
+static __dead void	 fail(const char *, ...)
+    __attribute__((__format__ (printf, 1, 2)));
+static void		 fuzz_init(void);
+static void		 fuzz_key(const unsigned char *, size_t);
+static void		 fuzz_match(const unsigned char *, size_t);
+static void		 match_compare(const char *, const struct outcome *,
+    size_t);
+static void		 match_engine(int);
+static size_t		 match_reference(struct outcome *);
+static int		 outcomecmp(const void *, const void *);
+static const char	*ref_casechr(const char *, const char *);
+static const char	*ref_caseprefix(const char *, const char *);
+static int		 ref_char(wchar_t *, const char *);
+static size_t		 ref_escape(const char *);
+static void		 ref_fields(const char *, size_t *, size_t *);
+static int		 ref_fuzzy(const char *, const char *, ssize_t *,
+    ssize_t *);
+static enum key		 ref_get_key(const unsigned char *, size_t *,
+    unsigned char *);
+static int		 ref_literal(enum match_mode, const char *,
+    const char *, ssize_t *, ssize_t *);
+static void		 set_query(const char *, size_t);
+static long long	 ticks(void);
+
+static struct {
+	long long	 engine;	/* nanoseconds spent in pick */
+	long long	 reference;	/* nanoseconds spent in references */
+	uint64_t	 signature;	/* outcome of the last input */
+} stats;
+static const unsigned char	*current;	/* input being processed */
+static size_t			 current_size;
+static int			 ref_icase;	/* references disregard case */
+static struct refkey		 refkeys[nitems(keys)];
+static size_t			 nrefkeys;
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	static int init;
+
+	if (!init) {
+		fuzz_init();
+		init = 1;
+	}
+	if (size == 0 || size > FUZZ_MAX)
+		return 0;
+
+	arena_reset(&frame_arena);
+	current = data;
+	current_size = size;
+	stats.signature = 0;
+	/* The least significant bit of the first byte selects the target. */
+	if (data[0] & 1)
+		fuzz_key(data + 1, size - 1);
+	else
+		fuzz_match(data, size);
+
+	return 0;
+}
+
+static void
+fuzz_init(void)
+{
+	const char *str;
+	char tiostr[2];
+	size_t i, j;
+	int error;
+
+	if (setlocale(LC_CTYPE, "en_US.UTF-8") == NULL &&
+	    setlocale(LC_CTYPE, "C.UTF-8") == NULL)
+		warnx("UTF-8 locale not available");
+	if (setupterm("xterm", -1, &error) == ERR)
+		warnx("xterm: terminfo entry not available");
+
+	/* Tiny chunks, causing the threads to steal from each other. */
+	cachesize = 1;
+
+	tio.c_cc[VINTR] = '\003';
+	tio.c_cc[VSUSP] = '\032';
+	keys_init();
+
+	/*
+	 * A key is ignored if it's a prefix of, or prefixed by, a preceding
+	 * key.
+	 */
+	for (i = 0; keys[i].key != UNKNOWN; i++) {
+		if (keys[i].tio >= 0) {
+			tiostr[0] = tio.c_cc[keys[i].tio];
+			tiostr[1] = '\0';
+			if ((str = strdup(tiostr)) == NULL)
+				err(1, NULL);
+		} else if (keys[i].cap != NULL) {
+			str = tty_getcap(keys[i].cap);
+		} else {
+			str = keys[i].str;
+		}
+		if (*str == '\0')
+			continue;
+
+		for (j = 0; j < nrefkeys; j++)
+			if (strncmp(refkeys[j].str, str,
+			    strlen(refkeys[j].str)) == 0 ||
+			    strncmp(refkeys[j].str, str, strlen(str)) == 0)
+				break;
+		if (j == nrefkeys) {
+			refkeys[nrefkeys].key = keys[i].key;
+			refkeys[nrefkeys].str = str;
+			nrefkeys++;
+		}
+	}
+}
+
+/*
+ * The first byte of the input selects the bound on the number of matches,
+ * the number of threads, whether to sort and whether to use smart-case. The
+ * remaining bytes are the query followed by the choices, all separated by
+ * newlines. The number of lines available to the choices, which determines how
+ * many matches are refined while filtering, and the fields matched are derived
+ * from the size.
+ */
+static void
+fuzz_match(const unsigned char *data, size_t size)
+{
+	struct outcome *want;
+	char *buf, *p, *q;
+	size_t i, n, nwant;
+	static const size_t ranges[][2] = { { 0, 0 }, { 1, 1 }, { 2, 3 },
+	    { 2, 0 } };
+	unsigned char sig[5];
+	unsigned char flags;
+
+	flags = data[0];
+	maxmatches = (flags >> 1) & 0x3;
+	nthreads = ((flags >> 3) & 0x7) + 1;
+	sort = (flags & 0x40) == 0;
+	casing = flags & 0x80 ? CASE_SMART : CASE_IGNORE;
+	choices_lines = size % 4;
+	fields.first = ranges[size / 4 % nitems(ranges)][0];
+	fields.last = ranges[size / 4 % nitems(ranges)][1];
+	/* The casing is not part of the query, force it to be compiled. */
+	free(matcher.query);
+	matcher.query = NULL;
+	matcher.size = 0;
+
+	/* NUL separates choices as well. */
+	if ((buf = malloc(size)) == NULL)
+		err(1, NULL);
+	for (i = 1; i < size; i++)
+		buf[i - 1] = data[i] == '\0' ? '\n' : data[i];
+	buf[size - 1] = '\0';
+	if ((p = strchr(buf, '\n')) != NULL)
+		*p++ = '\0';
+	else
+		p = buf + strlen(buf);
+
+	for (n = 0, q = p; *q != '\0'; q++)
+		n += *q == '\n';
+	n += *p != '\0' && q[-1] != '\n';
+	choices.size = choices.length = n;
+	choices.ascii = 1;
+	for (q = p; *q != '\0'; q++)
+		if ((unsigned char)*q >= 0x80)
+			choices.ascii = 0;
+	if ((choices.v = reallocarray(NULL, n + 1, sizeof(*choices.v))) ==
+	    NULL)
+		err(1, NULL);
+	for (i = 0; i < n; i++, p = q + 1) {
+		if ((q = strchr(p, '\n')) == NULL)
+			q = p + strlen(p);
+		*q = '\0';
+		memset(&choices.v[i], 0, sizeof(choices.v[i]));
+		choices.v[i].string = p;
+		choices.v[i].description = "";
+		choices.v[i].length = q - p;
+		choices.v[i].match_start = choices.v[i].match_end = -1;
+		if (fields.first > 0)
+			split_fields(&choices.v[i], " ");
+	}
+	matches.size = n;
+	if (maxmatches > 0 && maxmatches < matches.size)
+		matches.size = maxmatches;
+	if ((matches.v = reallocarray(NULL, matches.size + 1,
+	    sizeof(*matches.v))) == NULL ||
+	    (want = reallocarray(NULL, n + 1, sizeof(*want))) == NULL)
+		err(1, NULL);
+	matches.length = 0;
+	matches.complete = 1;
+
+	/* Filter using the whole query. */
+	set_query(buf, strlen(buf));
+	nwant = match_reference(want);
+	match_engine(0);
+	match_compare("whole query", want, nwant);
+
+	/*
+	 * Refine the matches from the first half of the query, split on a
+	 * character boundary as the query is always edited by whole characters.
+	 */
+	for (i = strlen(buf) / 2; i > 0 && isu8cont(buf[i]); i--)
+		continue;
+	if (i > 0) {
+		set_query(buf, i);
+		match_engine(0);
+		set_query(buf, strlen(buf));
+		match_engine(1);
+		match_compare("refined query", want, nwant);
+	}
+
+	/* Classify the input, used while minimizing a corpus. */
+	sig[0] = matcher.mode;
+	sig[1] = matcher.ascii | matcher.bytewise << 1 | matcher.icase << 2;
+	sig[2] = nwant < 4 ? nwant : 4;
+	sig[3] = memchr(data, '\033', size) != NULL;
+	sig[4] = flags & 0xc6;
+	stats.signature = hash((const char *)sig, sizeof(sig), HASH_SEED);
+
+	free(choices.v);
+	free(matches.v);
+	free(want);
+	free(buf);
+	choices.v = NULL;
+	matches.v = NULL;
+}
+
+static void
+set_query(const char *s, size_t len)
+{
+	free(query);
+	if ((query = strndup(s, len)) == NULL)
+		err(1, NULL);
+	query_length = strlen(query);
+	query_size = query_length + 1;
+}
+
+static void
+match_engine(int grew)
+{
+	long long t;
+
+	t = ticks();
+	filter_choices(grew, 0);
+	stats.engine += ticks() - t;
+}
+
+/*
+ * Match all choices against the query and rank the matches the same way as
+ * pick, using nothing but the references.
+ */
+static size_t
+match_reference(struct outcome *want)
+{
+	enum match_mode mode = MATCH_FUZZY;
+	const char *pattern = query;
+	char *field, *literal;
+	struct choice *c;
+	regex_t re;
+	regmatch_t rm;
+	wchar_t wc;
+	size_t fend, fstart, i, len, n;
+	long long t;
+	ssize_t end, start;
+	int error = 0;
+	int matched, w;
+
+	t = ticks();
+
+	len = query_length;
+	if (len > 2 && query[0] == '/' && query[len - 1] == '/') {
+		mode = MATCH_REGEX;
+		pattern++;
+		len -= 2;
+	} else if (len > 1 && query[0] == '\'') {
+		mode = MATCH_EXACT;
+		pattern++;
+		len--;
+	} else if (len > 1 && query[0] == '^') {
+		mode = MATCH_PREFIX;
+		pattern++;
+		len--;
+	} else if (len > 1 && query[len - 1] == '$') {
+		mode = MATCH_SUFFIX;
+		len--;
+	}
+	if ((literal = strndup(pattern, len)) == NULL)
+		err(1, NULL);
+	/* Smart-case respects case once an uppercase character is present. */
+	ref_icase = 1;
+	for (i = 0; casing == CASE_SMART && literal[i] != '\0'; i += w)
+		if ((w = ref_char(&wc, &literal[i])) == 0)
+			w = 1;
+		else if (iswupper(wc))
+			ref_icase = 0;
+	if (mode == MATCH_REGEX)
+		error = regcomp(&re, literal,
+		    REG_EXTENDED | (ref_icase ? REG_ICASE : 0));
+
+	for (i = n = 0; i < choices.length; i++) {
+		c = &choices.v[i];
+		start = end = -1;
+		/* Only the selected fields are matched, using a copy. */
+		ref_fields(c->string, &fstart, &fend);
+		if ((field = strndup(c->string + fstart, fend - fstart)) ==
+		    NULL)
+			err(1, NULL);
+		if (query_length == 0)
+			matched = 1;
+		else if (mode == MATCH_FUZZY)
+			matched = ref_fuzzy(field, query, &start, &end);
+		else if (mode == MATCH_REGEX)
+			matched = !error &&
+			    regexec(&re, field, 1, &rm, 0) == 0 &&
+			    (start = rm.rm_so, end = rm.rm_eo, 1);
+		else
+			matched = ref_literal(mode, field, literal, &start,
+			    &end);
+		free(field);
+		if (!matched)
+			continue;
+		if (query_length > 0) {
+			start += fstart;
+			end += fstart;
+		}
+
+		want[n].index = i;
+		want[n].start = start;
+		want[n].end = end;
+		if (query_length == 0)
+			want[n].score = 0;
+		else if (!sort)
+			want[n].score = 1;
+		else if (mode == MATCH_FUZZY)
+			want[n].score = (double)query_length/(end - start)/
+			    c->length;
+		else
+			want[n].score = 1.0 / (c->length + 1);
+		n++;
+	}
+	qsort(want, n, sizeof(*want), outcomecmp);
+	if (maxmatches > 0 && n > maxmatches)
+		n = maxmatches;
+
+	if (mode == MATCH_REGEX && !error)
+		regfree(&re);
+	free(literal);
+
+	stats.reference += ticks() - t;
+
+	return n;
+}
+
+/*
+ * The leading matches refined while filtering must be exact, followed by all
+ * matches once the rest are refined. While not sorting, at least the matches
+ * filling the lines available must be found, followed by the rest on demand.
+ */
+static void
+match_compare(const char *what, const struct outcome *want, size_t nwant)
+{
+	const struct choice *c;
+	size_t i;
+	long long t;
+
+	if (matches.length > nwant ||
+	    (matches.length < nwant && matches.length < choices_lines))
+		fail("%s: want %zu matches, got %zu", what, nwant,
+		    matches.length);
+	if (matches.exact > matches.length)
+		fail("%s: want at most %zu exact matches, got %zu", what,
+		    matches.length, matches.exact);
+	for (i = 0; i < nwant; i++) {
+		if (i == matches.length) {
+			t = ticks();
+			more_matches(SIZE_MAX);
+			stats.engine += ticks() - t;
+			if (matches.length != nwant)
+				fail("%s: want %zu matches, got %zu", what,
+				    nwant, matches.length);
+		}
+		if (i == matches.exact) {
+			t = ticks();
+			refine_matches();
+			stats.engine += ticks() - t;
+		}
+		c = matches.v[i];
+		if (c != &choices.v[want[i].index])
+			fail("%s: match %zu: want choice %zu, got %zu", what, i,
+			    want[i].index, (size_t)(c - choices.v));
+		if (c->match_start != want[i].start ||
+		    c->match_end != want[i].end)
+			fail("%s: choice %zu: want match %zd-%zd, got %zd-%zd",
+			    what, want[i].index, want[i].start, want[i].end,
+			    c->match_start, c->match_end);
+		if (c->score != want[i].score)
+			fail("%s: choice %zu: want score %g, got %g", what,
+			    want[i].index, want[i].score, c->score);
+	}
+}
+
+static int
+outcomecmp(const void *p1, const void *p2)
+{
+	const struct outcome *o1 = p1;
+	const struct outcome *o2 = p2;
+
+	if (o1->score != o2->score)
+		return o1->score < o2->score ? 1 : -1;
+	return o1->index < o2->index ? -1 : o1->index > o2->index;
+}
+
+/*
+ * The decoder input is followed by padding, ensuring any key started within
+ * the input can be completed without reading from the terminal.
+ */
+static void
+fuzz_key(const unsigned char *data, size_t size)
+{
+	unsigned char want[8];
+	const char *got;
+	size_t n, pos;
+	long long t;
+	enum key k1, k2;
+
+	if (size > sizeof(tty_ibuf.v) - FUZZ_PAD)
+		size = sizeof(tty_ibuf.v) - FUZZ_PAD;
+	memcpy(tty_ibuf.v, data, size);
+	memset(tty_ibuf.v + size, '~', FUZZ_PAD);
+	tty_ibuf.pos = 0;
+	tty_ibuf.length = size + FUZZ_PAD;
+
+	for (n = 0, pos = 0; pos < size; n++) {
+		t = ticks();
+		k1 = ref_get_key(tty_ibuf.v, &pos, want);
+		stats.reference += ticks() - t;
+
+		t = ticks();
+		k2 = get_key(&got);
+		stats.engine += ticks() - t;
+
+		if (k1 != k2 || memcmp(want, got, sizeof(want)) != 0)
+			fail("key %zu: want %u, got %u", n, k1, k2);
+		if (pos != tty_ibuf.pos)
+			fail("key %zu: want %zu bytes read, got %zu", n, pos,
+			    tty_ibuf.pos);
+		/* Classify the input by the set of keys decoded. */
+		stats.signature |= 1ULL << 63 | 1ULL << k1;
+	}
+}
+
+static __dead void
+fail(const char *fmt, ...)
+{
+	va_list ap;
+	size_t i;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\ninput:");
+	for (i = 0; i < current_size; i++)
+		fprintf(stderr, " %02x", current[i]);
+	fprintf(stderr, "\n");
+	abort();
+}
+
+/*
+ * Determine the span of the selected fields of s, separated by spaces. The span
+ * is empty at the end of s if the fields are missing.
+ */
+static void
+ref_fields(const char *s, size_t *start, size_t *end)
+{
+	size_t first, i, len, n;
+
+	len = strlen(s);
+	if (fields.first == 0) {
+		*start = 0;
+		*end = len;
+		return;
+	}
+
+	*start = *end = len;
+	for (i = n = 0; i < len; i++) {
+		if (s[i] == ' ')
+			continue;
+		for (first = i; i < len && s[i] != ' '; i++)
+			continue;
+		n++;
+		if (n == fields.first)
+			*start = first;
+		if (n >= fields.first &&
+		    (fields.last == 0 || n <= fields.last))
+			*end = i;
+	}
+}
+
+/*
+ * Returns the number of bytes occupied by the escape sequence at the beginning
+ * of s, if any.
+ */
+static size_t
+ref_escape(const char *s)
+{
+	size_t i;
+
+	if (s[0] != '\033' || (s[1] != '[' && s[1] != ']'))
+		return 0;
+	for (i = 2; s[i] != '\0'; i++) {
+		if (s[1] == '[' && s[i] >= '@' && s[i] <= '~')
+			return i + 1;
+		if (s[1] == ']' && s[i] == '\a')
+			return i + 1;
+	}
+	return i;
+}
+
+/*
+ * Decode the character at the beginning of s, returning its length or zero if
+ * invalid.
+ */
+static int
+ref_char(wchar_t *wc, const char *s)
+{
+	int n;
+
+	if ((n = mbtowc(wc, s, MB_CUR_MAX)) == -1) {
+		(void)mbtowc(NULL, NULL, MB_CUR_MAX);
+		return 0;
+	}
+	return n;
+}
+
+/*
+ * Returns the first character in s, outside of escape sequences, equal to the
+ * first character of q, disregarding case if requested.
+ */
+static const char *
+ref_casechr(const char *s, const char *q)
+{
+	wchar_t wc1, wc2;
+	size_t n;
+
+	if (ref_char(&wc2, q) == 0)
+		return NULL;
+	for (; *s != '\0'; s += n) {
+		if ((n = ref_escape(s)) > 0)
+			continue;
+		if ((n = ref_char(&wc1, s)) == 0)
+			n = 1;
+		else if (ref_icase ? towlower(wc1) == towlower(wc2) :
+		    wc1 == wc2)
+			return s;
+	}
+	return NULL;
+}
+
+/*
+ * Returns a pointer past p in s if s starts with p, disregarding case if
+ * requested.
+ */
+static const char *
+ref_caseprefix(const char *s, const char *p)
+{
+	wchar_t wc1, wc2;
+	int n1, n2;
+
+	while (*p != '\0') {
+		if (MB_CUR_MAX == 1 || ((unsigned char)*p & 0xc0) != 0xc0) {
+			if (ref_icase ? REF_FOLD(*s) != REF_FOLD(*p) :
+			    *s != *p)
+				return NULL;
+			s++, p++;
+			continue;
+		}
+		if ((n1 = ref_char(&wc1, s)) == 0 ||
+		    (n2 = ref_char(&wc2, p)) == 0 ||
+		    (ref_icase ? towlower(wc1) != towlower(wc2) : wc1 != wc2))
+			return NULL;
+		s += n1, p += n2;
+	}
+	return s;
+}
+
+/*
+ * Find the shortest, and among those the left-most, match of the query
+ * characters in order by trying every possible start.
+ */
+static int
+ref_fuzzy(const char *string, const char *q, ssize_t *start, ssize_t *end)
+{
+	wchar_t wc;
+	const char *e, *p, *s;
+	size_t i;
+	ssize_t len;
+	ssize_t best = -1;
+
+	for (p = string; (s = ref_casechr(p, q)) != NULL; p = s + 1) {
+		e = s;
+		for (i = 0;;) {
+			/* Step past the characters just matched. */
+			e += ref_char(&wc, e);
+			i += ref_char(&wc, &q[i]);
+			if (q[i] == '\0')
+				break;
+			if ((e = ref_casechr(e, &q[i])) == NULL)
+				break;
+		}
+		/* A later start can only match if this one did. */
+		if (e == NULL)
+			break;
+
+		len = e - s;
+		if (best == -1 || len < best) {
+			best = len;
+			*start = s - string;
+			*end = e - string;
+		}
+	}
+
+	return best != -1;
+}
+
+static int
+ref_literal(enum match_mode mode, const char *string, const char *pattern,
+    ssize_t *start, ssize_t *end)
+{
+	const char *e, *s, *t;
+	size_t n;
+
+	s = string;
+	if (mode == MATCH_PREFIX) {
+		while ((n = ref_escape(s)) > 0)
+			s += n;
+		if ((e = ref_caseprefix(s, pattern)) == NULL)
+			return 0;
+		*start = s - string;
+		*end = e - string;
+		return 1;
+	}
+
+	for (; (s = ref_casechr(s, pattern)) != NULL; s++) {
+		if ((e = ref_caseprefix(s, pattern)) == NULL)
+			continue;
+		if (mode == MATCH_SUFFIX) {
+			for (t = e; (n = ref_escape(t)) > 0; t += n)
+				continue;
+			if (*t != '\0')
+				continue;
+		}
+		*start = s - string;
+		*end = e - string;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Decode the key at position pos of v in the same manner as get_key() but
+ * trying each key in turn.
+ */
+static enum key
+ref_get_key(const unsigned char *v, size_t *pos, unsigned char *buf)
+{
+	size_t i, len, n;
+	int c, prefix;
+
+	memset(buf, 0, 8);
+	len = 0;
+	buf[len++] = v[(*pos)++];
+	for (;;) {
+		prefix = 0;
+		for (i = 0; i < nrefkeys; i++) {
+			n = strlen(refkeys[i].str);
+			if (n < len || memcmp(refkeys[i].str, buf, len) != 0)
+				continue;
+			if (n == len)
+				return refkeys[i].key;
+			prefix = 1;
+		}
+		if (!prefix || len == 7)
+			break;
+		buf[len++] = v[(*pos)++];
+	}
+
+	if (len > 1 && buf[0] == '\033' && (buf[1] == '[' || buf[1] == 'O')) {
+		for (c = buf[len - 1]; c < '@' || c > '~';)
+			c = v[(*pos)++];
+		return UNKNOWN;
+	}
+
+	if (MB_CUR_MAX == 1 || (buf[0] & 0xc0) != 0xc0)
+		return isprint(buf[0]) ? PRINTABLE : UNKNOWN;
+
+	while ((buf[0] << len) & 0x80) {
+		if (len == 7)
+			return UNKNOWN;
+		buf[len++] = v[(*pos)++];
+	}
+	return PRINTABLE;
+}
+
+static long long
+ticks(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#ifndef LIBFUZZER
+
+static void		 corpus_replay(const char *);
+static void		 corpus_save(const unsigned char *, size_t);
+static __dead void	 fuzz_usage(void);
+static size_t		 generate(unsigned char *, size_t, uint64_t *);
+
+static struct {
+	uint64_t	*v;
+	size_t		 length;
+	size_t		 size;
+	const char	*dir;
+} corpus;
+
+int
+main(int argc, char *argv[])
+{
+	static unsigned char buf[FUZZ_MAX];
+	const char *errstr;
+	uint64_t seed = 1;
+	long long count = 100000;
+	long long i;
+	size_t n;
+	int benchmark = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "bm:n:s:")) != -1)
+		switch (c) {
+		case 'b':
+			benchmark = 1;
+			break;
+		case 'm':
+			corpus.dir = optarg;
+			break;
+		case 'n':
+			count = strtonum(optarg, 1, LLONG_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "count %s: %s", errstr, optarg);
+			break;
+		case 's':
+			seed = strtonum(optarg, 1, LLONG_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "seed %s: %s", errstr, optarg);
+			break;
+		default:
+			fuzz_usage();
+		}
+	argc -= optind;
+	argv += optind;
+
+	if (argc > 0) {
+		for (; argc > 0; argc--, argv++)
+			corpus_replay(*argv);
+	} else {
+		for (i = 0; i < count; i++) {
+			n = generate(buf, sizeof(buf), &seed);
+			LLVMFuzzerTestOneInput(buf, n);
+			corpus_save(buf, n);
+		}
+	}
+
+	if (benchmark)
+		printf("engine %.3fs, reference %.3fs\n", stats.engine / 1e9,
+		    stats.reference / 1e9);
+
+	return 0;
+}
+
+static __dead void
+fuzz_usage(void)
+{
+	fprintf(stderr, "usage: fuzz [-b] [-m dir] [-n count] [-s seed] "
+	    "[file ...]\n");
+	exit(1);
+}
+
+/*
+ * Generate input biased towards Unicode, escape sequences, query operators and
+ * keys.
+ */
+static size_t
+generate(unsigned char *buf, size_t size, uint64_t *seed)
+{
+	static const char *fragments[] = {
+		"a", "b", "A", "B", "ab", "x", ".", " ", "\n", "\n", "\n",
+		"'", "^", "$", "/", "/a.*b/", "[", "(",
+		"\303\251", "\303\211", "\303\237", "\342\204\252", "k", "K",
+		"\305\277", "s", "S", "\346\227\245", "\303", "\251", "\200",
+		"\033", "\033[1;32m", "\033[m", "\033]0;t\a", "\033[", "\033]",
+		"\033OA", "\033OB", "\033[3~", "\033[1;5C", "\033\n",
+		"\033\177", "\177", "\b", "\003", "\025", "\027",
+	};
+	const char *f;
+	size_t i, len, n, nfragments;
+
+	/* Xorshift, good enough to pick fragments. */
+#define RANDOM() (*seed ^= *seed << 13, *seed ^= *seed >> 7,		\
+	*seed ^= *seed << 17)
+
+	len = 0;
+	buf[len++] = RANDOM();
+	/* Occasionally enough choices to be split among the threads. */
+	nfragments = RANDOM() % 8 == 0 ? 1024 : 48;
+	nfragments = RANDOM() % nfragments;
+	for (i = 0; i < nfragments; i++) {
+		if (RANDOM() % 16 == 0) {
+			buf[len++] = RANDOM();
+			if (len == size)
+				break;
+			continue;
+		}
+		f = fragments[RANDOM() % nitems(fragments)];
+		if ((n = strlen(f)) >= size - len)
+			break;
+		memcpy(buf + len, f, n);
+		len += n;
+	}
+#undef RANDOM
+
+	return len;
+}
+
+/*
+ * Run the input read from path, or all files if path is a directory.
+ */
+static void
+corpus_replay(const char *path)
+{
+	static unsigned char buf[FUZZ_MAX];
+	char name[PATH_MAX];
+	struct dirent *dp;
+	DIR *dir;
+	ssize_t n;
+	int fd;
+
+	if ((dir = opendir(path)) != NULL) {
+		while ((dp = readdir(dir)) != NULL) {
+			if (dp->d_name[0] == '.')
+				continue;
+			(void)snprintf(name, sizeof(name), "%s/%s", path,
+			    dp->d_name);
+			corpus_replay(name);
+		}
+		closedir(dir);
+		return;
+	}
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		err(1, "%s", path);
+	if ((n = read(fd, buf, sizeof(buf))) == -1)
+		err(1, "%s", path);
+	close(fd);
+	LLVMFuzzerTestOneInput(buf, n);
+	corpus_save(buf, n);
+}
+
+/*
+ * While minimizing, write the input to the corpus directory unless an input
+ * with the same outcome is already present.
+ */
+static void
+corpus_save(const unsigned char *buf, size_t size)
+{
+	char name[PATH_MAX];
+	size_t i;
+	int fd;
+
+	if (corpus.dir == NULL)
+		return;
+
+	for (i = 0; i < corpus.length; i++)
+		if (corpus.v[i] == stats.signature)
+			return;
+	if (corpus.length == corpus.size) {
+		corpus.size = corpus.size ? corpus.size * 2 : 64;
+		if ((corpus.v = reallocarray(corpus.v, corpus.size,
+		    sizeof(*corpus.v))) == NULL)
+			err(1, NULL);
+	}
+	corpus.v[corpus.length++] = stats.signature;
+
+	(void)snprintf(name, sizeof(name), "%s/%016llx", corpus.dir,
+	    (unsigned long long)stats.signature);
+	if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+		err(1, "%s", name);
+	if (write(fd, buf, size) == -1)
+		err(1, "%s", name);
+	close(fd);
+}
+
+#endif
@@ -1,21 +1,86 @@
 #include "config.h"
 
 #include <sys/ioctl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <ctype.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <locale.h>
 #include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 #include <wctype.h>
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define ARENA_ALIGN	16
+#define ARENA_CHUNK	(64 * 1024)
+#define ARENA_HEADER	((sizeof(struct arena_chunk) + ARENA_ALIGN - 1) & \
+    ~(size_t)(ARENA_ALIGN - 1))
+
+#define HISTORY_MAGIC	"pickhist"
+#define HASH_SEED	0x9e3779b97f4a7c15ULL
+#define HASH_SEED_CHECK	0x2545f4914f6cdd1dULL
+
+#define HISTORY_MAX	(64 * 1024)	/* number of lines kept */
+#define HISTORY_SIZE	64
+#define HISTORY_VERSION	1
+
+#define INPUT_BUFSIZ	(64 * 1024)
+
+#define PREVIEW_CACHE	16
+#define PREVIEW_MAX	(64 * 1024)
+
+#define RELOAD_DELAY	100	/* milliseconds */
+#define RELOAD_KEYS	32	/* deferred keys kept */
+#define RELOAD_WAIT	1000	/* milliseconds */
+
+#define JUMP_LABELS	"asdfghjklqwertyuiopzxcvbnm"
+#define JUMP_NLABELS	(sizeof(JUMP_LABELS) - 1)
+
+#define SCAN_BUDGET	(1024 * 1024)
+#define SCAN_CACHE	(256 * 1024)	/* fallback L2 cache size */
+#ifndef SCAN_MIN
+#define SCAN_MIN	(16 * 1024)
+#endif
+
+#define SEGMENT_MIN	(1024 * 1024)
+#ifndef SORT_MIN
+#define SORT_MIN	(64 * 1024)
+#endif
+#define SORT_WIDTH	16
+#define SPILL_BUFSIZ	(1024 * 1024)
+#define THREADS_MAX	1024
+
+#define SNAPSHOT_MAGIC	"picksnap"
+#define SNAPSHOT_VERSION	1
+
+#define SNAPSHOT_ASCII		0x1	/* only consists of ASCII */
+#define SNAPSHOT_DESCRIPTIONS	0x2
+#define SNAPSHOT_UNIQUE		0x4
+#define SNAPSHOT_UNIQUE_LAST	0x8
+
 #define tty_putp(capability, fatal) do {				\
 	if (tputs((capability), 1, tty_putc) == ERR && (fatal))		\
 		errx(1, #capability ": unknown terminfo capability");	\
@@ -45,6 +110,28 @@ enum key {
 	END = 20,
 	HOME = 21,
 	PRINTABLE = 22,
+	REDRAW = 23,
+	JUMP = 24,
+};
+
+enum casing {
+	CASE_IGNORE,
+	CASE_SMART,
+	CASE_SENSITIVE,
+};
+
+enum input_format {
+	INPUT_RAW,
+	INPUT_GZIP,
+	INPUT_ZSTD,
+};
+
+enum match_mode {
+	MATCH_FUZZY,
+	MATCH_EXACT,
+	MATCH_PREFIX,
+	MATCH_SUFFIX,
+	MATCH_REGEX,
 };
 
 struct choice {
@@ -54,50 +141,448 @@ struct choice {
 	ssize_t		 match_start;	/* inclusive match start offset */
 	ssize_t		 match_end;	/* exclusive match end offset */
 	double		 score;
+	double		 frecency;	/* selection history bonus */
+	size_t		 field_start;	/* inclusive start of selected fields */
+	size_t		 field_end;	/* exclusive end of selected fields */
+};
+
+struct history_header {
+	char		 magic[8];
+	uint32_t	 version;
+	uint32_t	 nslots;
+	uint64_t	 nused;
+};
+
+/*
+ * Memory handed out by an arena is carved from a list of chunks, newest first.
+ */
+struct arena_chunk {
+	struct arena_chunk	*next;
+	size_t			 size;
+	size_t			 length;
+};
+
+struct arena {
+	struct arena_chunk	*chunks;
+	size_t			 size;		/* total size of all chunks */
+};
+
+/*
+ * A snapshot consists of the header, followed by the NUL-separated text of all
+ * choices and finally the choices themselves aligned on a 8 byte boundary.
+ */
+struct snapshot_header {
+	char		 magic[8];
+	uint32_t	 version;
+	uint32_t	 flags;
+	uint64_t	 first;		/* selected fields */
+	uint64_t	 last;
+	uint64_t	 length;	/* length of the text */
+	uint64_t	 nchoices;
+};
+
+/*
+ * A choice stored in a snapshot, offsets are relative to the text.
+ */
+struct snapshot_choice {
+	uint64_t	 string;
+	uint64_t	 description;
+	uint64_t	 length;
+	uint64_t	 field_start;
+	uint64_t	 field_end;
+};
+
+struct history_slot {
+	uint64_t	 hash;		/* line hash, zero if unused */
+	int64_t		 time;		/* last selection */
+	uint32_t	 count;		/* number of selections */
+	uint32_t	 check;		/* second line hash, zero if unknown */
+};
+
+struct keystate {
+	enum key	 key;		/* UNKNOWN unless a complete key */
+	int		 nnext;
+	short		 next[256];	/* zero if there's no transition */
+};
+
+struct rank {
+	double		 score;
+	struct choice	*choice;
+};
+
+struct preview_entry {
+	const struct choice	*choice;
+	char			*output;
+	size_t			 length;
+	size_t			 size;
+	unsigned long		 used;		/* least recently used tick */
+};
+
+/*
+ * Range of candidates left to visit by a thread while filtering in parallel.
+ */
+struct scan_range {
+	pthread_mutex_t	 lock;
+	size_t		 next;		/* next candidate to visit */
+	size_t		 end;		/* exclusive end of the range */
+	double		*best;		/* k best scores seen so far */
+	size_t		 nbest;
+	int		 skipped;	/* any choice only matched greedily */
+};
+
+struct run {
+	struct rank	*v;
+	struct rank	*tmp;
+	size_t		 n;
+};
+
+struct merge {
+	const struct rank	*a;
+	const struct rank	*b;
+	struct rank		*out;
+	size_t			 na;
+	size_t			 nb;
+	size_t			 start;	/* inclusive output offset */
+	size_t			 end;	/* exclusive output offset */
+};
+
+struct segment {
+	char		*start;
+	char		*end;
+	const char	*ifs;
+	const struct snapshot_choice *stored;	/* snapshot choices */
+	size_t		 offset;	/* index of the first choice */
+	size_t		 nlines;
+	int		 ascii;		/* only consists of ASCII */
+};
+
+/*
+ * Span of matched bytes in a choice.
+ */
+struct span {
+	size_t	 start;		/* inclusive */
+	size_t	 end;		/* exclusive */
 };
 
+static void			 add_match(struct choice *, size_t *, int *);
+static void			 add_score(double *, size_t *, size_t, double);
+static void			*arena_alloc(struct arena *, size_t, size_t);
+static void			 arena_free(struct arena *);
+static void			 arena_reset(struct arena *);
 static int			 choicecmp(const void *, const void *);
+static void			*count_lines(void *);
+static size_t			 cpu_count(void);
+static void			 dedup_choices(void);
 static void			 delete_between(char *, size_t, size_t, size_t);
 static char			*eager_strpbrk(const char *, const char *);
-static int			 filter_choices(size_t);
-static char			*get_choices(void);
+static int			 filter_choices(int, int);
+static int			 fuzzy_match(const char *, size_t, size_t,
+    const char **, const char **);
+static char			*get_choices(size_t *);
 static enum key			 get_key(const char **);
-static void			 handle_sigwinch(int);
+static void			 handle_signal(int);
+static uint64_t			 hash(const char *, size_t, uint64_t);
+static double			 history_frecency(const struct choice *);
+static void			 history_map(void);
+static void			 history_open(const char *);
+static void			 history_record(const struct choice *);
+static struct history_slot	*history_slot(uint64_t, uint32_t);
+static int			 historycmp(const void *, const void *);
+static const char		*horspool(const char *, size_t);
+static void			 input_close(void);
+static int			 input_fill(void);
+static size_t			 input_gunzip(char *, size_t);
+static void			 input_open(void);
+static size_t			 input_read(char *, size_t);
+static size_t			 input_unzstd(char *, size_t);
 static int			 isu8cont(unsigned char);
 static int			 isu8start(unsigned char);
 static int			 isword(const char *);
-static size_t			 min_match(const char *, size_t, ssize_t *,
-    ssize_t *);
-static size_t			 print_choices(size_t, size_t);
-static void			 print_line(const char *, size_t, int, ssize_t,
-    ssize_t);
+static void			 keys_init(void);
+static int			 keystate_new(void);
+static void			 kill_command(pid_t *, int *);
+static int			 match_choice(struct choice *, int);
+static struct span		*match_spans(const struct choice *, size_t *);
+static void			 matches_init(void);
+static void			 merge(const struct rank *, size_t,
+    const struct rank *, size_t, struct rank *);
+static void			*merge_runs(void *);
+static size_t			 merge_split(const struct rank *, size_t,
+    const struct rank *, size_t, size_t);
+static size_t			 min_match(const char *, size_t, size_t,
+    ssize_t *, ssize_t *);
+static void			 more_matches(size_t);
+static void			 parse_fields(const char *);
+static void			 preview_clear(void);
+static void			 preview_print(void);
+static int			 preview_read(void);
+static void			 preview_select(const struct choice *);
+static void			 pool_stop(void);
+static void			*pool_work(void *);
+static size_t			 print_choices(size_t, size_t, size_t);
+static void			 print_line(const char *, size_t, unsigned int,
+    int, const struct span *, size_t);
+static void			 print_query(size_t);
+static int			 query_compile(void);
+static int			 query_match(const char *, size_t, ssize_t *,
+    ssize_t *, int);
+static int			 rankcmp(const struct rank *,
+    const struct rank *);
+static void			 refine_matches(void);
+static int			 regex_match(const char *, size_t,
+    regmatch_t *);
+static void			 reload_deadline(long);
+static int			 reload_defer(enum key);
+static enum key			 reload_key(void);
+static int			 reload_read(void);
+static void			 reload_schedule(void);
+static void			 reload_start(void);
+static int			 reload_timeout(void);
+static pid_t			 run_command(const char *, const char *, int *);
+static void			 run_threads(void *(*)(void *), void *, size_t,
+    size_t);
+static int			 scan_choices(size_t, int);
+static void			 scan_interrupt(size_t, size_t, size_t, size_t);
+static int			 scan_parallel(size_t, size_t, int, int *);
+static void			*scan_run(void *);
+static int			 scan_take(struct scan_range *, int, size_t *,
+    size_t *);
+static void			 score_match(struct choice *);
 static const struct choice	*selected_choice(void);
+static void			 signal_action(int, void (*)(int));
 static size_t			 skipescseq(const char *);
-static const char		*strcasechr(const char *, const char *);
-static void			 toggle_sigwinch(int);
+static char			*snapshot_read(const char *, size_t *);
+static void			*snapshot_split(void *);
+static void			 snapshot_write(const char *, const char *,
+    size_t);
+static void			 sort_matches(size_t);
+static void			*sort_run(void *);
+static char			*spill_input(size_t *);
+static void			 split_fields(struct choice *, const char *);
+static void			*split_lines(void *);
+static const char		*strbytechr(const char *, const char *,
+    const char *);
+static const char		*strcasechr(const char *, const char *,
+    const char *);
+static const char		*strcaseprefix(const char *, const char *,
+    const char *);
 static int			 tty_getc(void);
 static const char		*tty_getcap(char *);
 static void			 tty_init(int);
+static int			 tty_pending(void);
 static const char		*tty_parm1(char *, int);
 static int			 tty_putc(int);
 static void			 tty_restore(int);
 static void			 tty_size(void);
+static enum key			 tty_wait(void);
+static int			 visit_choice(struct choice *, double *,
+    size_t *, size_t, int *);
 static __dead void		 usage(void);
 static int			 xmbtowc(wchar_t *, const char *);
 
+#define	CAP(k, s)	{ k,	s,	NULL,	-1 }
+#define	KEY(k, s)	{ k,	NULL,	s,	-1 }
+#define	TIO(k, i)	{ k,	NULL,	NULL,	i }
+static const struct {
+	enum key	 key;
+	char		*cap;
+	const char	*str;
+	int		 tio;
+} keys[] = {
+	KEY(ALT_ENTER,	"\033\n"),
+	KEY(BACKSPACE,	"\177"),
+	KEY(BACKSPACE,	"\b"),
+	KEY(CTRL_A,	"\001"),
+	TIO(CTRL_C,	VINTR),
+	KEY(CTRL_E,	"\005"),
+	KEY(CTRL_K,	"\013"),
+	KEY(CTRL_L,	"\014"),
+	KEY(CTRL_O,	"\017"),
+	KEY(CTRL_U,	"\025"),
+	KEY(CTRL_W,	"\027"),
+	KEY(CTRL_W,	"\033\177"),
+	KEY(CTRL_W,	"\033\b"),
+	TIO(CTRL_Z,	VSUSP),
+	CAP(DEL,	"kdch1"),
+	KEY(DEL,	"\004"),
+	CAP(END,	"kend"),
+	KEY(END,	"\033>"),
+	KEY(ENTER,	"\n"),
+	CAP(ENTER,	"kent"),
+	CAP(HOME,	"khome"),
+	KEY(HOME,	"\033<"),
+	KEY(JUMP,	"\033j"),
+	CAP(LEFT,	"kcub1"),
+	KEY(LEFT,	"\002"),
+	KEY(LEFT,	"\033OD"),
+	CAP(LINE_DOWN,	"kcud1"),
+	KEY(LINE_DOWN,	"\016"),
+	KEY(LINE_DOWN,	"\033OB"),
+	CAP(LINE_UP,	"kcuu1"),
+	KEY(LINE_UP,	"\020"),
+	KEY(LINE_UP,	"\033OA"),
+	CAP(PAGE_DOWN,	"knp"),
+	KEY(PAGE_DOWN,	"\026"),
+	KEY(PAGE_DOWN,	"\033 "),
+	CAP(PAGE_UP,	"kpp"),
+	KEY(PAGE_UP,	"\033v"),
+	CAP(RIGHT,	"kcuf1"),
+	KEY(RIGHT,	"\006"),
+	KEY(RIGHT,	"\033OC"),
+	KEY(UNKNOWN,	NULL),
+};
+
 static struct termios		 tio;
+static struct arena		 frame_arena;	/* released for each frame */
+static struct arena		 load_arena;	/* released once loaded */
 static struct {
 	size_t		 size;
 	size_t		 length;
 	struct choice	*v;
+	int		 ascii;		/* only consists of ASCII */
 } choices;
+static struct {
+	size_t		  size;
+	size_t		  length;
+	struct choice	**v;
+	size_t		  count;	/* number of matching choices */
+	size_t		  exact;	/* number of leading matches refined */
+	size_t		  next;		/* next choice to visit */
+	size_t		  ncandidates;	/* number of choices to visit */
+	int		  grew;		/* visit the previous matches */
+	int		  complete;	/* all matching choices visited */
+	int		  partial;	/* count is a lower bound */
+} matches;
+static struct {
+	char		 *map;
+	size_t		  size;
+	struct choice	**table;	/* zero-filled table used by -u */
+	size_t		  ntable;
+} spill;
+static struct {
+	char		*map;
+	size_t		 size;
+} snapshot;
+static struct {
+	enum input_format format;
+	unsigned char	*buf;		/* read but not yet consumed input */
+	size_t		 pos;
+	size_t		 length;
+	int		 eof;
+	int		 end;		/* compressed stream ended */
+#ifdef HAVE_ZLIB
+	z_stream	 gzip;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_DStream	*zstd;
+#endif
+} source;
+static struct {
+	struct history_header	*header;
+	struct history_slot	*slots;
+	const char		*path;
+	size_t			 size;
+	time_t			 now;
+	int			 fd;
+} history;
+static struct {
+	struct keystate	*v;
+	size_t		 length;
+	size_t		 size;
+} keystates;
+static struct {
+	enum match_mode	 mode;
+	char		*query;		/* query last compiled */
+	char		*pattern;
+	size_t		 length;
+	size_t		 size;		/* size of query and pattern */
+	char		(*sets)[4];	/* bytes accepted per character */
+	const unsigned char *fold;	/* fold or same, see icase */
+	size_t		 skip[256];	/* Horspool shift table */
+	regex_t		 regex;
+	size_t		 nchars;	/* number of characters in the query */
+	int		 ascii;		/* pattern only consists of ASCII */
+	int		 bytewise;	/* fuzzy query is matched bytewise */
+	int		 icase;		/* disregard case */
+	int		 error;		/* invalid regular expression */
+} matcher;
+static struct {
+	struct preview_entry	 cache[PREVIEW_CACHE];
+	const struct choice	*choice;	/* selected choice */
+	const char		*command;
+	char			*output;	/* output of the choice */
+	size_t			 length;
+	size_t			 size;
+	unsigned long		 tick;
+	pid_t			 pid;		/* running command, if any */
+	int			 fd;
+} preview = { .pid = -1, .fd = -1 };
+static struct {
+	const char		*command;
+	char			*output;	/* output of the command */
+	size_t			 length;
+	size_t			 size;
+	size_t			 offset;	/* start of partial line */
+	struct timespec		 deadline;	/* when to run the command */
+	enum key		 keys[RELOAD_KEYS];
+	size_t			 nkeys;		/* number of deferred keys */
+	pid_t			 pid;		/* running command, if any */
+	int			 fd;
+	int			 pending;	/* run scheduled at deadline */
+	int			 replace;	/* output replaces choices */
+	int			 replaced;	/* replaced since drawn */
+	int			 started;
+} reload = { .pid = -1, .fd = -1 };
+static struct {
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 work;		/* signaled once a job is posted */
+	pthread_cond_t	 done;		/* signaled once a job is completed */
+	void		*(*fn)(void *);
+	char		*args;
+	size_t		 size;		/* size of each argument */
+	size_t		 n;		/* number of arguments */
+	size_t		 pending;	/* number of workers still running */
+	size_t		 nworkers;
+	unsigned long	 job;		/* incremented for each job */
+	int		 quit;		/* workers exit once set */
+	pthread_t	 threads[THREADS_MAX];
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+static struct {
+	struct scan_range *v;
+	size_t		 n;
+	size_t		 k;		/* number of best scores kept */
+	size_t		 chunk;		/* candidates visited at once */
+	int		 interruptible;
+	int		 interrupted;
+} scan;
+static struct {
+	size_t		 first;		/* zero if all fields are matched */
+	size_t		 last;		/* zero if unbounded */
+} fields;
+static unsigned char		 fold[256], same[256];
+static struct {
+	unsigned char	 v[BUFSIZ];
+	size_t		 pos;
+	size_t		 length;
+} tty_ibuf;
 static FILE			*tty_in, *tty_out;
 static char			*query;
 static size_t			 query_length, query_size;
-static volatile sig_atomic_t	 gotsigwinch;
-static unsigned int		 choices_lines, tty_columns, tty_lines;
+static unsigned int		 choices_lines, preview_lines, tty_columns,
+				 tty_lines;
+static size_t			 nthreads = 1;
+static int			 signal_pipe[2];
+static size_t			 maxmatches;
+static size_t			 maxscan = SCAN_BUDGET;
+static long			 cachesize;
+static enum casing		 casing = CASE_IGNORE;
 static int			 descriptions;
 static int			 sort = 1;
+static int			 unique, unique_last;
 static int			 use_alternate_screen = 1;
 static int			 use_keypad = 1;
 
@@ -105,24 +590,62 @@ int
 main(int argc, char *argv[])
 {
 	const struct choice *choice;
+	const char *errstr;
+	const char *history_path = NULL;
+	const char *snapshot_input = NULL;
+	const char *snapshot_output = NULL;
+	char promises[64];
 	char *input;
+	size_t i, length;
 	int output_description = 0;
 	int rc = 0;
 	int c;
 
 	setlocale(LC_CTYPE, "");
 
-	if (pledge("stdio tty rpath wpath cpath", NULL) == -1)
+	nthreads = cpu_count();
+
+	if (pledge("stdio tty rpath wpath cpath flock proc exec", NULL) == -1)
 		err(1, "pledge");
 
-	while ((c = getopt(argc, argv, "doq:KSxX")) != -1)
+	while ((c = getopt(argc, argv, "Ccdf:H:j:l:m:n:op:q:r:KSuUw:xX")) != -1)
 		switch (c) {
+		case 'c':
+			casing = CASE_SMART;
+			break;
+		case 'C':
+			casing = CASE_SENSITIVE;
+			break;
 		case 'd':
 			descriptions = 1;
 			break;
+		case 'f':
+			snapshot_input = optarg;
+			break;
+		case 'H':
+			history_path = optarg;
+			break;
 		case 'K':
 			use_keypad = 0;
 			break;
+		case 'j':
+			nthreads = strtonum(optarg, 1, THREADS_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "threads %s: %s", errstr, optarg);
+			break;
+		case 'l':
+			maxscan = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "scan budget %s: %s", errstr, optarg);
+			break;
+		case 'm':
+			maxmatches = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "max matches %s: %s", errstr, optarg);
+			break;
+		case 'n':
+			parse_fields(optarg);
+			break;
 		case 'o':
 			/*
 			 * Only output description if descriptions are read and
@@ -130,15 +653,31 @@ main(int argc, char *argv[])
 			 */
 			output_description = descriptions;
 			break;
+		case 'p':
+			preview.command = optarg;
+			break;
 		case 'q':
 			if ((query = strdup(optarg)) == NULL)
 				err(1, "strdup");
 			query_length = strlen(query);
 			query_size = query_length + 1;
 			break;
+		case 'r':
+			reload.command = optarg;
+			break;
 		case 'S':
 			sort = 0;
 			break;
+		case 'u':
+			unique = 1;
+			unique_last = 0;
+			break;
+		case 'U':
+			unique = unique_last = 1;
+			break;
+		case 'w':
+			snapshot_output = optarg;
+			break;
 		case 'x':
 			use_alternate_screen = 1;
 			break;
@@ -159,25 +698,85 @@ main(int argc, char *argv[])
 			err(1, NULL);
 	}
 
-	input = get_choices();
+	if (history_path != NULL)
+		history_open(history_path);
+	if (reload.command == NULL) {
+		if (snapshot_input != NULL)
+			input = snapshot_read(snapshot_input, &length);
+		else
+			input = get_choices(&length);
+		if (snapshot_output != NULL) {
+			snapshot_write(snapshot_output, input, length);
+			return 0;
+		}
+		arena_free(&load_arena);
+		matches_init();
+	} else {
+		/* The choices are read from the output of the command. */
+		input = NULL;
+		choices.size = 1;
+		if ((choices.v = reallocarray(NULL, choices.size,
+		    sizeof(struct choice))) == NULL ||
+		    (matches.v = reallocarray(NULL, 1,
+		    sizeof(*matches.v))) == NULL)
+			err(1, NULL);
+	}
+	/*
+	 * Further updates of the history are serialized using an exclusive
+	 * lock.
+	 */
+	if (history.header != NULL && flock(history.fd, LOCK_UN) == -1)
+		err(1, "flock: %s", history_path);
 	tty_init(1);
 
-	if (pledge("stdio tty", NULL) == -1)
+	snprintf(promises, sizeof(promises), "stdio tty%s%s",
+	    history.header != NULL ? " flock" : "",
+	    preview.command != NULL || reload.command != NULL ?
+	    " proc exec" : "");
+	if (pledge(promises, NULL) == -1)
 		err(1, "pledge");
 
 	choice = selected_choice();
+	preview_clear();
+	kill_command(&reload.pid, &reload.fd);
 	tty_restore(1);
 	if (choice != NULL) {
 		printf("%s\n", choice->string);
 		if (output_description)
 			printf("%s\n", choice->description);
+		if (history.header != NULL)
+			history_record(choice);
 	} else {
 		rc = 1;
 	}
 
-	free(input);
-	free(choices.v);
+	pool_stop();
+	if (spill.map != NULL) {
+		munmap(spill.map, spill.size);
+	} else if (snapshot.map != NULL) {
+		munmap(snapshot.map, snapshot.size);
+		free(choices.v);
+	} else {
+		free(input);
+		free(choices.v);
+	}
+	if (history.header != NULL) {
+		munmap(history.header, history.size);
+		close(history.fd);
+	}
+	free(matches.v);
+	free(preview.output);
+	for (i = 0; i < PREVIEW_CACHE; i++)
+		free(preview.cache[i].output);
+	free(reload.output);
+	free(keystates.v);
+	if (matcher.mode == MATCH_REGEX && !matcher.error)
+		regfree(&matcher.regex);
+	free(matcher.query);
+	free(matcher.pattern);
+	free(matcher.sets);
 	free(query);
+	arena_free(&frame_arena);
 
 	return rc;
 }
@@ -185,158 +784,1721 @@ main(int argc, char *argv[])
 __dead void
 usage(void)
 {
-	fprintf(stderr, "usage: pick [-dKoSXx] [-q query]\n");
+	fprintf(stderr, "usage: pick [-CcdKoSUuXx] [-f file] [-H file] "
+	    "[-j threads] [-l budget]\n"
+	    "            [-m max] [-n fields] [-p command] [-q query] "
+	    "[-r command]\n"
+	    "            [-w file]\n");
 	exit(1);
 }
 
+/*
+ * Parse the range of fields to match on the form N, N-, -M or N-M where fields
+ * are numbered starting from 1.
+ */
+void
+parse_fields(const char *range)
+{
+	const char *errstr;
+	char *first, *last;
+
+	if ((first = strdup(range)) == NULL)
+		err(1, NULL);
+	if ((last = strchr(first, '-')) != NULL)
+		*last++ = '\0';
+
+	fields.first = 1;
+	if (*first != '\0') {
+		fields.first = strtonum(first, 1, INT_MAX, &errstr);
+		if (errstr != NULL)
+			errx(1, "fields %s: %s", errstr, range);
+	}
+	if (last == NULL) {
+		fields.last = fields.first;
+	} else if (*last != '\0') {
+		fields.last = strtonum(last, fields.first, INT_MAX, &errstr);
+		if (errstr != NULL)
+			errx(1, "fields %s: %s", errstr, range);
+	}
+
+	free(first);
+}
+
 char *
-get_choices(void)
+get_choices(size_t *len)
 {
-	char *buf, *description, *ifs, *start, *stop;
-	ssize_t n;
-	size_t length = 0;
+	struct segment *segments;
+	const char *ifs;
+	char *buf, *stop;
+	size_t i, length, n, nlines, nsegments;
 	size_t size = BUFSIZ;
 
 	if ((ifs = getenv("IFS")) == NULL || *ifs == '\0')
 		ifs = " ";
 
-	if ((buf = malloc(size)) == NULL)
-		err(1, NULL);
-	for (;;) {
-		if ((n = read(STDIN_FILENO, buf + length, size - length)) == -1)
-			err(1, "read");
-		else if (n == 0)
-			break;
+	if (maxmatches > 0) {
+		buf = spill_input(&length);
+	} else {
+		if ((buf = malloc(size)) == NULL)
+			err(1, NULL);
+		for (length = 0;;) {
+			if ((n = input_read(buf + length, size - length)) == 0)
+				break;
 
-		length += n;
-		if (length + 1 < size)
-			continue;
-		if ((buf = reallocarray(buf, 2, size)) == NULL)
+			length += n;
+			if (length + 1 < size)
+				continue;
+			if ((buf = reallocarray(buf, 2, size)) == NULL)
+				err(1, NULL);
+			size *= 2;
+		}
+		buf[length] = '\0';
+	}
+	input_close();
+
+	/*
+	 * Split the input into segments aligned on newlines, one per thread,
+	 * which are first counted and then turned into choices in parallel.
+	 * Since the number of lines in each segment is known before hand, the
+	 * choices end up in input order.
+	 */
+	nsegments = length / SEGMENT_MIN + 1;
+	if (nsegments > nthreads)
+		nsegments = nthreads;
+	segments = arena_alloc(&load_arena, nsegments, sizeof(*segments));
+	for (i = 0, stop = buf; i < nsegments; i++) {
+		segments[i].start = stop;
+		segments[i].ifs = ifs;
+		if (i + 1 == nsegments) {
+			stop = buf + length;
+		} else {
+			if (stop < buf + length / nsegments * (i + 1))
+				stop = buf + length / nsegments * (i + 1);
+			if ((stop = memchr(stop, '\n', buf + length - stop)))
+				stop++;
+			else
+				stop = buf + length;
+		}
+		segments[i].end = stop;
+	}
+	run_threads(count_lines, segments, nsegments, sizeof(*segments));
+	choices.ascii = 1;
+	for (i = 0, nlines = 0; i < nsegments; i++) {
+		segments[i].offset = nlines;
+		nlines += segments[i].nlines;
+		choices.ascii &= segments[i].ascii;
+	}
+
+	/*
+	 * Ensure room for a extra choice when ALT_ENTER is invoked. While
+	 * spilling, the choices are already allocated.
+	 */
+	if (maxmatches == 0) {
+		choices.size = nlines + 1;
+		if ((choices.v = reallocarray(NULL, choices.size,
+		    sizeof(struct choice))) == NULL)
 			err(1, NULL);
-		size *= 2;
 	}
-	buf[length] = '\0';
+	run_threads(split_lines, segments, nsegments, sizeof(*segments));
+	choices.length = nlines;
+
+	if (unique) {
+		dedup_choices();
+		/* Give back the memory occupied by the duplicates. */
+		if (maxmatches == 0) {
+			choices.size = choices.length + 1;
+			if ((choices.v = reallocarray(choices.v, choices.size,
+			    sizeof(struct choice))) == NULL)
+				err(1, NULL);
+		}
+	}
 
-	choices.size = 16;
-	if ((choices.v = reallocarray(NULL, choices.size,
-	    sizeof(struct choice))) == NULL)
+	*len = length;
+	return buf;
+}
+
+/*
+ * Allocate the matches once the choices are loaded. If the number of matches is
+ * bounded, only that many matches are kept in memory.
+ */
+void
+matches_init(void)
+{
+	matches.size = choices.length;
+	if (maxmatches > 0 && maxmatches < matches.size)
+		matches.size = maxmatches;
+	/* Always allocate at least one element, even for empty input. */
+	if ((matches.v = reallocarray(NULL, matches.size + 1,
+	    sizeof(*matches.v))) == NULL)
 		err(1, NULL);
+}
+
+void *
+count_lines(void *arg)
+{
+	struct segment *s = arg;
+	const char *p;
+	unsigned char bits = 0;
+
+	s->nlines = 0;
+	for (p = s->start; (p = memchr(p, '\n', s->end - p)) != NULL; p++)
+		s->nlines++;
+
+	/* Input consisting of ASCII only allows bytewise matching. */
+	for (p = s->start; p < s->end; p++)
+		bits |= (unsigned char)*p;
+	s->ascii = (bits & 0x80) == 0;
+
+	return NULL;
+}
+
+void *
+split_lines(void *arg)
+{
+	struct segment *s = arg;
+	struct choice *c;
+	char *description, *start, *stop;
 
-	start = buf;
-	while ((stop = strchr(start, '\n')) != NULL) {
+	c = &choices.v[s->offset];
+	for (start = s->start;
+	    (stop = memchr(start, '\n', s->end - start)) != NULL;
+	    start = stop + 1, c++) {
 		*stop = '\0';
 
-		if (descriptions && (description = eager_strpbrk(start, ifs)))
+		if (descriptions &&
+		    (description = eager_strpbrk(start, s->ifs)))
 			*description++ = '\0';
 		else
 			description = "";
 
-		choices.v[choices.length].length = stop - start;
-		choices.v[choices.length].string = start;
-		choices.v[choices.length].description = description;
-		choices.v[choices.length].match_start = -1;
-		choices.v[choices.length].match_end = -1;
-		choices.v[choices.length].score = 0;
+		c->length = stop - start;
+		c->string = start;
+		c->description = description;
+		c->match_start = -1;
+		c->match_end = -1;
+		c->score = 0;
+		c->frecency = history.header != NULL ?
+		    history_frecency(c) : 0;
+		if (fields.first > 0)
+			split_fields(c, s->ifs);
+	}
+
+	return NULL;
+}
 
-		start = stop + 1;
+/*
+ * Determine the span of the selected fields of the choice. Fields are separated
+ * by one or many occurrences of IFS, ignoring leading ones. If the choice has
+ * fewer fields than the first selected one, the span is empty.
+ */
+void
+split_fields(struct choice *c, const char *ifs)
+{
+	const char *s = c->string;
+	size_t i, n;
 
-		/* Ensure room for a extra choice when ALT_ENTER is invoked. */
-		if (++choices.length + 1 < choices.size)
+	c->field_start = c->field_end = strlen(s);
+	for (i = 0, n = 0; s[i] != '\0';) {
+		if (strchr(ifs, s[i]) != NULL) {
+			i++;
 			continue;
-		choices.size *= 2;
-		if ((choices.v = reallocarray(choices.v, choices.size,
-		    sizeof(struct choice))) == NULL)
-			err(1, NULL);
+		}
+
+		if (++n == fields.first)
+			c->field_start = i;
+		while (s[i] != '\0' && strchr(ifs, s[i]) == NULL)
+			i++;
+		if (n >= fields.first)
+			c->field_end = i;
+		if (n == fields.last)
+			break;
 	}
+}
 
-	return buf;
+/*
+ * Remove duplicate choices, keeping either the first or last occurrence of each
+ * line. The remaining choices are compacted while preserving the input order.
+ * When keeping the last occurrence, the choices are visited backwards and
+ * compacted towards the end.
+ */
+void
+dedup_choices(void)
+{
+	struct choice **table;
+	struct choice *c, *dst;
+	size_t i, j, mask, n, slot;
+
+	n = choices.length;
+	for (mask = 1; mask < 2 * n; mask *= 2)
+		continue;
+	if (spill.table != NULL && spill.ntable >= mask) {
+		/* Backed by the file as well, see spill_input(). */
+		table = spill.table;
+	} else {
+		table = arena_alloc(&load_arena, mask, sizeof(*table));
+		memset(table, 0, mask * sizeof(*table));
+	}
+	mask--;
+
+	for (i = j = 0; i < n; i++) {
+		c = &choices.v[unique_last ? n - i - 1 : i];
+		for (slot = hash(c->string, c->length, HASH_SEED) & mask;
+		    table[slot] != NULL; slot = (slot + 1) & mask) {
+			if (table[slot]->length == c->length &&
+			    memcmp(table[slot]->string, c->string,
+			    c->length) == 0)
+				break;
+		}
+		if (table[slot] != NULL)
+			continue;
+
+		dst = &choices.v[unique_last ? n - j - 1 : j];
+		*dst = *c;
+		table[slot] = dst;
+		j++;
+	}
+	if (unique_last)
+		memmove(choices.v, choices.v + n - j, j * sizeof(*choices.v));
+	choices.length = j;
 }
 
-char *
-eager_strpbrk(const char *string, const char *separators)
+/*
+ * Hash the given bytes, one word at a time. Different seeds yield unrelated
+ * hashes of the same bytes.
+ */
+uint64_t
+hash(const char *s, size_t len, uint64_t seed)
 {
-	char *ptr = NULL;
-	char *tmp_ptr;
+	uint64_t h, w;
 
-	for (tmp_ptr = strpbrk(string, separators);
-	    tmp_ptr;
-	    tmp_ptr = strpbrk(tmp_ptr, separators))
-		ptr = tmp_ptr++;
+	h = seed ^ len;
+	for (; len >= sizeof(w); s += sizeof(w), len -= sizeof(w)) {
+		memcpy(&w, s, sizeof(w));
+		h = (h ^ w) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	w = 0;
+	memcpy(&w, s, len);
+	h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 29;
 
-	return ptr;
+	return h;
 }
 
-const struct choice *
-selected_choice(void)
+/*
+ * Open and map the selection history. The history is a hash table of selected
+ * lines, keyed by two unrelated hashes of each line. A shared lock is held
+ * while the choices are read.
+ */
+void
+history_open(const char *path)
 {
-	const char *buf;
-	size_t choices_count = 0;
-	size_t selection = 0;
-	size_t yscroll = 0;
-	size_t cursor_position, i, j, length, xscroll;
-	int dochoices = 0;
-	int dofilter = 1;
-	int query_grew = 0;
-
-	cursor_position = query_length;
+	struct history_header hdr;
+	struct stat st;
+
+	if ((history.fd = open(path, O_RDWR | O_CREAT, 0644)) == -1)
+		err(1, "open: %s", path);
+	if (flock(history.fd, LOCK_EX) == -1)
+		err(1, "flock: %s", path);
+	if (fstat(history.fd, &st) == -1)
+		err(1, "fstat: %s", path);
+	if (st.st_size == 0) {
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, HISTORY_MAGIC, sizeof(hdr.magic));
+		hdr.version = HISTORY_VERSION;
+		hdr.nslots = HISTORY_SIZE;
+		if (ftruncate(history.fd, sizeof(hdr) +
+		    HISTORY_SIZE * sizeof(struct history_slot)) == -1)
+			err(1, "ftruncate: %s", path);
+		if (pwrite(history.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+			err(1, "pwrite: %s", path);
+	}
+	if (flock(history.fd, LOCK_SH) == -1)
+		err(1, "flock: %s", path);
 
-	for (;;) {
-		/*
-		 * If the user didn't add more characters to the query all
-		 * choices have to be reconsidered as potential matches.
-		 * In the opposite scenario, there's no point in reconsidered
-		 * all choices again since the ones that didn't match the
-		 * previous query will clearly not match the current one due to
-		 * the fact that previous query is a left-most substring of the
-		 * current one.
-		 */
-		if (!query_grew)
-			choices_count = choices.length;
-		query_grew = 0;
-		if (dofilter) {
-			if ((dochoices = filter_choices(choices_count)))
-				dofilter = selection = yscroll = 0;
-		}
+	history.path = path;
+	history_map();
+	history.now = time(NULL);
+}
 
-		tty_putp(cursor_invisible, 0);
-		tty_putp(carriage_return, 1); /* move cursor to first column */
-		if (cursor_position >= tty_columns)
-			xscroll = cursor_position - tty_columns + 1;
-		else
-			xscroll = 0;
-		print_line(&query[xscroll], query_length - xscroll, 0, -1, -1);
-		if (dochoices) {
-			if (selection - yscroll >= choices_lines)
-				yscroll = selection - choices_lines + 1;
-			choices_count = print_choices(yscroll, selection);
-		}
-		tty_putp(carriage_return, 1); /* move cursor to first column */
-		for (i = j = 0; i < cursor_position; j++)
-			while (isu8cont(query[++i]))
-				continue;
-		if (j > 0)
-			/*
-			 * parm_right_cursor interprets 0 as 1, therefore only
-			 * move the cursor if the position is non zero.
-			 */
-			tty_putp(tty_parm1(parm_right_cursor, j), 1);
-		tty_putp(cursor_normal, 0);
-		fflush(tty_out);
+/*
+ * Map the history using the number of slots present in the header.
+ */
+void
+history_map(void)
+{
+	struct history_header hdr;
+	struct stat st;
+
+	if (history.header != NULL)
+		munmap(history.header, history.size);
+
+	if (pread(history.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    memcmp(hdr.magic, HISTORY_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != HISTORY_VERSION || hdr.nslots == 0 ||
+	    (hdr.nslots & (hdr.nslots - 1)) != 0 ||
+	    fstat(history.fd, &st) == -1 ||
+	    (size_t)st.st_size < sizeof(hdr) +
+	    hdr.nslots * sizeof(struct history_slot))
+		errx(1, "%s: invalid history file", history.path);
+
+	history.size = sizeof(hdr) + hdr.nslots * sizeof(struct history_slot);
+	history.header = mmap(NULL, history.size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, history.fd, 0);
+	if (history.header == MAP_FAILED)
+		err(1, "mmap: %s", history.path);
+	history.slots = (struct history_slot *)(history.header + 1);
+}
 
-		switch (get_key(&buf)) {
-		case ENTER:
-			if (choices_count > 0)
-				return &choices.v[selection];
-			break;
+/*
+ * Returns the slot for the given hashes, which is unused if absent. The second
+ * hash guards against collisions of the first one, a slot lacking it is only
+ * identified by the first hash.
+ */
+struct history_slot *
+history_slot(uint64_t h, uint32_t check)
+{
+	const struct history_slot *slot;
+	uint32_t i, mask;
+
+	mask = history.header->nslots - 1;
+	for (i = h & mask; history.slots[i].hash != 0; i = (i + 1) & mask) {
+		slot = &history.slots[i];
+		if (slot->hash == h &&
+		    (slot->check == 0 || slot->check == check))
+			break;
+	}
+
+	return &history.slots[i];
+}
+
+/*
+ * Order history slots by the time of the last selection, most recent first.
+ */
+int
+historycmp(const void *p1, const void *p2)
+{
+	const struct history_slot *s1 = p1;
+	const struct history_slot *s2 = p2;
+
+	if (s1->time > s2->time)
+		return -1;
+	if (s1->time < s2->time)
+		return 1;
+	return 0;
+}
+
+/*
+ * Returns the bonus of the given choice, favoring choices selected frequently
+ * and recently.
+ */
+double
+history_frecency(const struct choice *c)
+{
+	const struct history_slot *slot;
+	uint64_t h;
+	uint32_t check;
+	int64_t age;
+
+	if ((h = hash(c->string, c->length, HASH_SEED)) == 0)
+		h = 1;
+	if ((check = hash(c->string, c->length, HASH_SEED_CHECK)) == 0)
+		check = 1;
+	if ((slot = history_slot(h, check))->hash == 0)
+		return 0;
+
+	age = history.now - slot->time;
+	if (age < 60 * 60)
+		return slot->count * 4.0;
+	if (age < 24 * 60 * 60)
+		return slot->count * 2.0;
+	if (age < 7 * 24 * 60 * 60)
+		return slot->count * 0.5;
+	return slot->count * 0.25;
+}
+
+/*
+ * Record the selection of the given choice. If the history is about to become
+ * too crowded, it is grown and rehashed in place. Once the history holds
+ * HISTORY_MAX lines, it is instead rehashed keeping only the half most recently
+ * selected.
+ */
+void
+history_record(const struct choice *c)
+{
+	struct history_slot *slot, *slots;
+	uint64_t h;
+	uint32_t check, i, n, nslots;
+
+	if (flock(history.fd, LOCK_EX) == -1)
+		err(1, "flock: %s", history.path);
+	/* The history could have been grown by someone else in the meantime. */
+	history_map();
+
+	nslots = history.header->nslots;
+	if ((history.header->nused + 1) * 4 > (uint64_t)nslots * 3) {
+		if ((slots = reallocarray(NULL, nslots,
+		    sizeof(*slots))) == NULL)
+			err(1, NULL);
+		for (i = n = 0; i < nslots; i++) {
+			if (history.slots[i].hash != 0)
+				slots[n++] = history.slots[i];
+		}
+
+		if (n >= HISTORY_MAX) {
+			qsort(slots, n, sizeof(*slots), historycmp);
+			n = HISTORY_MAX / 2;
+		} else {
+			if (ftruncate(history.fd,
+			    sizeof(struct history_header) +
+			    2 * (size_t)nslots * sizeof(*slots)) == -1)
+				err(1, "ftruncate: %s", history.path);
+			history.header->nslots = 2 * nslots;
+			history_map();
+		}
+		memset(history.slots, 0,
+		    history.header->nslots * sizeof(*slots));
+		for (i = 0; i < n; i++)
+			*history_slot(slots[i].hash, slots[i].check) = slots[i];
+		history.header->nused = n;
+		free(slots);
+	}
+
+	if ((h = hash(c->string, c->length, HASH_SEED)) == 0)
+		h = 1;
+	if ((check = hash(c->string, c->length, HASH_SEED_CHECK)) == 0)
+		check = 1;
+	if ((slot = history_slot(h, check))->hash == 0) {
+		slot->hash = h;
+		history.header->nused++;
+	}
+	/* Lines recorded without the second hash get it once selected. */
+	slot->check = check;
+	slot->count++;
+	slot->time = time(NULL);
+
+	if (flock(history.fd, LOCK_UN) == -1)
+		err(1, "flock: %s", history.path);
+}
+
+/*
+ * Select the choice to preview, cancelling the command run for the previously
+ * selected choice. Unless the output for the choice is cached, the command is
+ * run in the background and its output read as it becomes available, see
+ * preview_read().
+ */
+void
+preview_select(const struct choice *c)
+{
+	struct preview_entry *e;
+	size_t i;
+
+	if (c == preview.choice)
+		return;
+
+	kill_command(&preview.pid, &preview.fd);
+	preview.choice = c;
+	preview.length = 0;
+	if (c == NULL)
+		return;
+
+	for (i = 0; i < PREVIEW_CACHE; i++) {
+		e = &preview.cache[i];
+		if (e->choice != c)
+			continue;
+
+		e->used = ++preview.tick;
+		if (e->length > preview.size) {
+			preview.size = e->length;
+			if ((preview.output = realloc(preview.output,
+			    preview.size)) == NULL)
+				err(1, NULL);
+		}
+		memcpy(preview.output, e->output, e->length);
+		preview.length = e->length;
+		return;
+	}
+
+	preview.pid = run_command(preview.command, c->string, &preview.fd);
+}
+
+/*
+ * Read the available output of the running command. Once the command exits or
+ * enough output to fill the preview is read, the command is cancelled and its
+ * output cached, evicting the least recently used entry. Returns non-zero if
+ * more output was read.
+ */
+int
+preview_read(void)
+{
+	struct preview_entry *e;
+	size_t i, nlines;
+	ssize_t n = -1;
+	int more = 0;
+
+	for (;;) {
+		if (preview.length == preview.size) {
+			if (preview.size == PREVIEW_MAX)
+				break;
+			preview.size = preview.size == 0 ?
+			    BUFSIZ : 2 * preview.size;
+			if (preview.size > PREVIEW_MAX)
+				preview.size = PREVIEW_MAX;
+			if ((preview.output = realloc(preview.output,
+			    preview.size)) == NULL)
+				err(1, NULL);
+		}
+
+		n = read(preview.fd, preview.output + preview.length,
+		    preview.size - preview.length);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && errno == EAGAIN)
+			break;
+		if (n == -1)
+			err(1, "read");
+		if (n == 0)
+			break;
+		preview.length += n;
+		more = 1;
+	}
+
+	for (i = nlines = 0; i < preview.length; i++)
+		if (preview.output[i] == '\n')
+			nlines++;
+	if (n != 0 && nlines < preview_lines && preview.length < PREVIEW_MAX)
+		return more;
+
+	kill_command(&preview.pid, &preview.fd);
+	e = &preview.cache[0];
+	for (i = 1; i < PREVIEW_CACHE; i++)
+		if (preview.cache[i].used < e->used)
+			e = &preview.cache[i];
+	/* The evicted entry's buffer is reused unless too small. */
+	if (e->size < preview.length + 1) {
+		e->size = preview.length + 1;
+		if ((e->output = realloc(e->output, e->size)) == NULL)
+			err(1, NULL);
+	}
+	memcpy(e->output, preview.output, preview.length);
+	e->length = preview.length;
+	e->choice = preview.choice;
+	e->used = ++preview.tick;
+
+	return 1;
+}
+
+/*
+ * Cancel the running command and empty the cache, causing the command to be
+ * run again for the selected choice. The buffers of the cache are kept.
+ */
+void
+preview_clear(void)
+{
+	size_t i;
+
+	kill_command(&preview.pid, &preview.fd);
+	for (i = 0; i < PREVIEW_CACHE; i++) {
+		preview.cache[i].choice = NULL;
+		preview.cache[i].length = 0;
+		preview.cache[i].used = 0;
+	}
+	preview.choice = NULL;
+}
+
+/*
+ * Print the lines of the preview, clearing any lines not occupied by output.
+ */
+void
+preview_print(void)
+{
+	const char *end, *nl, *p;
+	size_t i;
+
+	p = end = preview.output;
+	if (p != NULL)
+		end += preview.length;
+	for (i = 0; i < preview_lines; i++) {
+		if (p == end) {
+			print_line("", 0, tty_columns, 0, NULL, 0);
+			continue;
+		}
+
+		if ((nl = memchr(p, '\n', end - p)) == NULL)
+			nl = end;
+		print_line(p, nl - p, tty_columns, 0, NULL, 0);
+		p = nl < end ? nl + 1 : end;
+	}
+}
+
+/*
+ * Set the deadline to the given number of milliseconds from now.
+ */
+void
+reload_deadline(long ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, &reload.deadline);
+	reload.deadline.tv_sec += ms / 1000;
+	reload.deadline.tv_nsec += ms % 1000 * 1000000L;
+	if (reload.deadline.tv_nsec >= 1000000000L) {
+		reload.deadline.tv_sec++;
+		reload.deadline.tv_nsec -= 1000000000L;
+	}
+}
+
+/*
+ * Defer the key operating on the choices while the command run for the current
+ * query has not finished, allowing the key to act on its output. The command is
+ * run at once if scheduled. The deferred keys are handled in order once the
+ * command finishes or after a while, see reload_key(). Returns non-zero if the
+ * key was deferred.
+ */
+int
+reload_defer(enum key key)
+{
+	if (reload.nkeys == 0) {
+		if (reload.pending)
+			reload_start();
+		if (reload.pid == -1)
+			return 0;
+		reload_deadline(RELOAD_WAIT);
+	}
+	/* Any excess key is discarded. */
+	if (reload.nkeys < RELOAD_KEYS)
+		reload.keys[reload.nkeys++] = key;
+	return 1;
+}
+
+/*
+ * Returns the next deferred key once it is no longer deferred, otherwise
+ * UNKNOWN.
+ */
+enum key
+reload_key(void)
+{
+	enum key key;
+
+	if (reload.nkeys == 0 || reload_timeout() > 0)
+		return UNKNOWN;
+
+	key = reload.keys[0];
+	memmove(reload.keys, reload.keys + 1,
+	    --reload.nkeys * sizeof(*reload.keys));
+	return key;
+}
+
+/*
+ * Schedule the command to run once the query has not changed for a while,
+ * killing the command run for the previous query along with discarding the keys
+ * deferred for it. The command is run at once for the initial query.
+ */
+void
+reload_schedule(void)
+{
+	kill_command(&reload.pid, &reload.fd);
+	reload.nkeys = 0;
+	if (!reload.started) {
+		reload_start();
+		return;
+	}
+
+	reload_deadline(RELOAD_DELAY);
+	reload.pending = 1;
+}
+
+/*
+ * Run the command with the query as its first positional argument. Its output
+ * replaces the choices once available, see reload_read().
+ */
+void
+reload_start(void)
+{
+	reload.pid = run_command(reload.command, query, &reload.fd);
+	reload.pending = 0;
+	reload.replace = reload.started = 1;
+}
+
+/*
+ * Returns the number of milliseconds until the command is scheduled to run, or
+ * until the deferred keys no longer wait for the running command. Otherwise, -1
+ * is returned.
+ */
+int
+reload_timeout(void)
+{
+	struct timespec now;
+	long long ms;
+
+	if (!reload.pending && (reload.nkeys == 0 || reload.pid == -1))
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (reload.deadline.tv_sec - now.tv_sec) * 1000LL +
+	    (reload.deadline.tv_nsec - now.tv_nsec) / 1000000L;
+	return ms > 0 ? ms : 0;
+}
+
+/*
+ * Read the available output of the running command, turning each complete line
+ * into a choice. All choices are considered matches, the filtering is left to
+ * the command. Returns non-zero if the choices changed or the command finished.
+ */
+int
+reload_read(void)
+{
+	struct segment seg;
+	struct choice *c;
+	uintptr_t old;
+	char *stop;
+	size_t i;
+	ssize_t n;
+	int more = 0;
+
+	/*
+	 * The cached previews are keyed by the address of the choices which
+	 * changes once replaced or reallocated below.
+	 */
+	if (reload.replace) {
+		preview_clear();
+		choices.length = matches.length = matches.count = 0;
+		matches.exact = 0;
+		reload.length = reload.offset = 0;
+		reload.replace = 0;
+		reload.replaced = more = 1;
+	}
+
+	for (;;) {
+		/* Leave room for a trailing newline, see below. */
+		if (reload.size - reload.length <= 1) {
+			old = (uintptr_t)reload.output;
+			reload.size = reload.size == 0 ?
+			    BUFSIZ : 2 * reload.size;
+			if ((reload.output = realloc(reload.output,
+			    reload.size)) == NULL)
+				err(1, NULL);
+			/*
+			 * Rebase the choices on the new buffer, the description
+			 * could reside outside of it.
+			 */
+			for (i = 0; i < choices.length; i++) {
+				c = &choices.v[i];
+				c->string = reload.output +
+				    ((uintptr_t)c->string - old);
+				if ((uintptr_t)c->description >= old &&
+				    (uintptr_t)c->description <
+				    old + reload.length)
+					c->description = reload.output +
+					    ((uintptr_t)c->description - old);
+			}
+		}
+
+		n = read(reload.fd, reload.output + reload.length,
+		    reload.size - reload.length - 1);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && errno == EAGAIN)
+			break;
+		if (n == -1)
+			err(1, "read");
+		if (n == 0) {
+			/* Terminate any partial line and stop reading. */
+			if (reload.length > reload.offset)
+				reload.output[reload.length++] = '\n';
+			kill_command(&reload.pid, &reload.fd);
+			break;
+		}
+		reload.length += n;
+	}
+
+	for (stop = reload.output + reload.length;
+	    stop > reload.output + reload.offset && stop[-1] != '\n'; stop--)
+		continue;
+	if (stop == reload.output + reload.offset)
+		return more || reload.pid == -1;
+
+	memset(&seg, 0, sizeof(seg));
+	seg.start = reload.output + reload.offset;
+	seg.end = stop;
+	if ((seg.ifs = getenv("IFS")) == NULL || *seg.ifs == '\0')
+		seg.ifs = " ";
+	seg.offset = choices.length;
+	count_lines(&seg);
+	reload.offset = seg.end - reload.output;
+
+	/* Ensure room for a extra choice when ALT_ENTER is invoked. */
+	if (choices.length + seg.nlines + 1 > choices.size) {
+		choices.size = 2 * (choices.length + seg.nlines + 1);
+		if ((choices.v = reallocarray(choices.v, choices.size,
+		    sizeof(struct choice))) == NULL)
+			err(1, NULL);
+		preview_clear();
+	}
+	split_lines(&seg);
+	choices.length += seg.nlines;
+	/* If the number of matches is bounded, only that many are kept. */
+	if (maxmatches > 0 && choices.length >= maxmatches) {
+		choices.length = maxmatches;
+		kill_command(&reload.pid, &reload.fd);
+	}
+
+	if (choices.length > matches.size) {
+		matches.size = choices.size;
+		if ((matches.v = reallocarray(matches.v, matches.size + 1,
+		    sizeof(*matches.v))) == NULL)
+			err(1, NULL);
+	}
+	for (i = 0; i < choices.length; i++)
+		matches.v[i] = &choices.v[i];
+	matches.length = matches.count = matches.exact = choices.length;
+	matches.complete = 1;
+
+	return 1;
+}
+
+/*
+ * Run the command using sh(1) in the background with the given argument as its
+ * first positional argument. The read end of a non-blocking pipe connected to
+ * the standard output and error of the command is stored in fd.
+ */
+pid_t
+run_command(const char *command, const char *arg, int *fd)
+{
+	pid_t pid;
+	int fds[2];
+	int devnull;
+
+	if (pipe(fds) == -1)
+		err(1, "pipe");
+
+	switch ((pid = fork())) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		/*
+		 * Run the command in its own process group, allowing all of
+		 * its descendants to be killed once cancelled. Since the
+		 * terminal output is buffered, exit without flushing it.
+		 */
+		setpgid(0, 0);
+		close(fileno(tty_in));
+		close(fileno(tty_out));
+		if (history.header != NULL)
+			close(history.fd);
+		if ((devnull = open("/dev/null", O_RDONLY)) == -1 ||
+		    dup2(devnull, STDIN_FILENO) == -1 ||
+		    dup2(fds[1], STDOUT_FILENO) == -1 ||
+		    dup2(fds[1], STDERR_FILENO) == -1) {
+			warn("dup2");
+			_exit(1);
+		}
+		close(fds[0]);
+		close(fds[1]);
+		execl("/bin/sh", "sh", "-c", command, "pick", arg,
+		    (char *)NULL);
+		warn("/bin/sh");
+		_exit(1);
+	}
+
+	/* Also set by the child, whichever comes first. */
+	setpgid(pid, pid);
+	close(fds[1]);
+	if (fcntl(fds[0], F_SETFL, O_NONBLOCK) == -1 ||
+	    fcntl(fds[0], F_SETFD, FD_CLOEXEC) == -1)
+		err(1, "fcntl");
+	*fd = fds[0];
+
+	return pid;
+}
+
+/*
+ * Kill the command started by run_command(), if any, including all of its
+ * descendants.
+ */
+void
+kill_command(pid_t *pid, int *fd)
+{
+	if (*pid == -1)
+		return;
+
+	kill(-*pid, SIGKILL);
+	while (waitpid(*pid, NULL, 0) == -1 && errno == EINTR)
+		continue;
+	close(*fd);
+	*pid = *fd = -1;
+}
+
+/*
+ * Returns the number of processors available to the process, honoring any
+ * affinity mask it's restricted to.
+ */
+size_t
+cpu_count(void)
+{
+	long ncpus;
+#ifdef HAVE_SCHED_GETAFFINITY
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(set), &set) == 0 &&
+	    (ncpus = CPU_COUNT(&set)) > 0)
+		return ncpus > THREADS_MAX ? THREADS_MAX : ncpus;
+#endif
+
+	if ((ncpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		return 1;
+	return ncpus > THREADS_MAX ? THREADS_MAX : ncpus;
+}
+
+/*
+ * Run fn on each of the n arguments, each one of the given size, in parallel.
+ * The first argument is handled by the calling thread and the rest by the
+ * worker threads of the pool. The worker threads are started once needed and
+ * then kept around until pool_stop(), the same worker always handles the same
+ * argument index.
+ */
+void
+run_threads(void *(*fn)(void *), void *args, size_t n, size_t size)
+{
+	sigset_t mask, omask;
+	int error;
+
+	if (n <= 1) {
+		fn(args);
+		return;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	if (pool.nworkers < n - 1) {
+		/* Leave the signals to the main thread. */
+		sigfillset(&mask);
+		pthread_sigmask(SIG_SETMASK, &mask, &omask);
+		for (; pool.nworkers < n - 1; pool.nworkers++) {
+			error = pthread_create(&pool.threads[pool.nworkers],
+			    NULL, pool_work,
+			    (void *)(uintptr_t)(pool.nworkers + 1));
+			if (error)
+				errx(1, "pthread_create: %s", strerror(error));
+		}
+		pthread_sigmask(SIG_SETMASK, &omask, NULL);
+	}
+	pool.fn = fn;
+	pool.args = args;
+	pool.size = size;
+	pool.n = n;
+	pool.pending = n - 1;
+	pool.job++;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+
+	fn(args);
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.pending > 0)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/*
+ * Stop and join the worker threads of the pool, if any.
+ */
+void
+pool_stop(void)
+{
+	size_t i;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.quit = 1;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (i = 0; i < pool.nworkers; i++)
+		pthread_join(pool.threads[i], NULL);
+	pool.nworkers = 0;
+	pool.quit = 0;
+}
+
+/*
+ * Worker thread of the pool, see run_threads(). The argument is the index of
+ * the worker, which exits once the pool is stopped.
+ */
+void *
+pool_work(void *arg)
+{
+	void *(*fn)(void *);
+	char *args;
+	size_t i = (uintptr_t)arg;
+	unsigned long job;
+
+	pthread_mutex_lock(&pool.lock);
+	/* The worker is started right before the job it's started for. */
+	job = pool.job - 1;
+	for (;;) {
+		while (pool.job == job && !pool.quit)
+			pthread_cond_wait(&pool.work, &pool.lock);
+		if (pool.quit)
+			break;
+		job = pool.job;
+		if (i >= pool.n)
+			continue;
+
+		fn = pool.fn;
+		args = pool.args + i * pool.size;
+		pthread_mutex_unlock(&pool.lock);
+		fn(args);
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.pending == 0)
+			pthread_cond_signal(&pool.done);
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	return NULL;
+}
+
+/*
+ * Copy the input to an unlinked temporary file and map it, followed by room
+ * for the choices and the table used to remove duplicates, if needed. All of
+ * them are then backed by the file allowing the kernel to page them out instead
+ * of being bounded by the amount of available memory. This only holds as long
+ * as the file does not reside on a memory backed file system, such as tmpfs.
+ */
+char *
+spill_input(size_t *length)
+{
+	char path[PATH_MAX];
+	const char *p, *tmpdir;
+	char *buf;
+	ssize_t nw;
+	size_t n;
+	size_t nlines = 0;
+	size_t offset;
+	int fd, len;
+
+	if ((tmpdir = getenv("TMPDIR")) == NULL || *tmpdir == '\0')
+		tmpdir = "/tmp";
+	len = snprintf(path, sizeof(path), "%s/pick.XXXXXXXXXX", tmpdir);
+	if (len < 0 || len >= (int)sizeof(path))
+		errx(1, "%s: path too long", tmpdir);
+	if ((fd = mkstemp(path)) == -1)
+		err(1, "mkstemp: %s", path);
+	if (unlink(path) == -1)
+		err(1, "unlink: %s", path);
+
+	buf = arena_alloc(&load_arena, SPILL_BUFSIZ, 1);
+	for (*length = 0;;) {
+		if ((n = input_read(buf, SPILL_BUFSIZ)) == 0)
+			break;
+
+		for (p = buf; (p = memchr(p, '\n', buf + n - p)) != NULL; p++)
+			nlines++;
+		for (p = buf; p < buf + n; p += nw)
+			if ((nw = write(fd, p, buf + n - p)) == -1)
+				err(1, "write: %s", path);
+		*length += n;
+	}
+
+	/*
+	 * The input is followed by its NUL-terminator and the choices,
+	 * including room for a extra choice when ALT_ENTER is invoked. The
+	 * zero-filled extension of the file takes care of the NUL-terminator.
+	 */
+	offset = (*length + 1 + sizeof(double) - 1) & ~(sizeof(double) - 1);
+	spill.size = offset + (nlines + 1) * sizeof(struct choice);
+	if (unique) {
+		for (spill.ntable = 1; spill.ntable < 2 * (nlines + 1);
+		    spill.ntable *= 2)
+			continue;
+		spill.size += spill.ntable * sizeof(*spill.table);
+	}
+	if (ftruncate(fd, spill.size) == -1)
+		err(1, "ftruncate: %s", path);
+	spill.map = mmap(NULL, spill.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    fd, 0);
+	if (spill.map == MAP_FAILED)
+		err(1, "mmap: %s", path);
+	close(fd);
+	/* Filtering streams through the choices in input order. */
+	(void)posix_madvise(spill.map, spill.size, POSIX_MADV_SEQUENTIAL);
+
+	choices.size = nlines + 1;
+	choices.v = (struct choice *)(spill.map + offset);
+	if (unique)
+		spill.table = (struct choice **)(choices.v + choices.size);
+
+	return spill.map;
+}
+
+/*
+ * Map the snapshot at path and turn it into choices, which requires no parsing
+ * of the text. The text is never written to, so the mapping is read-only. The
+ * options affecting how the choices are read must match the ones used while
+ * writing the snapshot.
+ */
+char *
+snapshot_read(const char *path, size_t *length)
+{
+	struct snapshot_header hdr;
+	struct segment *segments;
+	struct stat st;
+	size_t i, n, nsegments, offset;
+	uint32_t flags;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		err(1, "open: %s", path);
+	if (fstat(fd, &st) == -1)
+		err(1, "fstat: %s", path);
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != SNAPSHOT_VERSION ||
+	    hdr.length > (uint64_t)st.st_size ||
+	    hdr.nchoices > (uint64_t)st.st_size /
+	    sizeof(struct snapshot_choice))
+		errx(1, "%s: invalid snapshot file", path);
+	offset = (sizeof(hdr) + hdr.length + 1 + sizeof(uint64_t) - 1) &
+	    ~(sizeof(uint64_t) - 1);
+	if ((uint64_t)st.st_size !=
+	    offset + hdr.nchoices * sizeof(struct snapshot_choice))
+		errx(1, "%s: invalid snapshot file", path);
+
+	flags = (descriptions ? SNAPSHOT_DESCRIPTIONS : 0) |
+	    (unique ? SNAPSHOT_UNIQUE : 0) |
+	    (unique_last ? SNAPSHOT_UNIQUE_LAST : 0);
+	if ((hdr.flags & ~SNAPSHOT_ASCII) != flags ||
+	    hdr.first != fields.first || hdr.last != fields.last)
+		errx(1, "%s: snapshot written using different options", path);
+
+	snapshot.size = st.st_size;
+	snapshot.map = mmap(NULL, snapshot.size, PROT_READ, MAP_SHARED, fd,
+	    0);
+	if (snapshot.map == MAP_FAILED)
+		err(1, "mmap: %s", path);
+	close(fd);
+	if (snapshot.map[sizeof(hdr) + hdr.length] != '\0')
+		errx(1, "%s: invalid snapshot file", path);
+
+	n = hdr.nchoices;
+	choices.size = n + 1;
+	if ((choices.v = reallocarray(NULL, choices.size,
+	    sizeof(struct choice))) == NULL)
+		err(1, NULL);
+	choices.length = n;
+	choices.ascii = (hdr.flags & SNAPSHOT_ASCII) != 0;
+
+	/* The choices are spread evenly among the threads. */
+	nsegments = n * sizeof(struct snapshot_choice) / SEGMENT_MIN + 1;
+	if (nsegments > nthreads)
+		nsegments = nthreads;
+	segments = arena_alloc(&load_arena, nsegments, sizeof(*segments));
+	for (i = 0; i < nsegments; i++) {
+		segments[i].start = snapshot.map + sizeof(hdr);
+		segments[i].end = segments[i].start + hdr.length;
+		segments[i].offset = n / nsegments * i;
+		segments[i].nlines = i + 1 == nsegments ?
+		    n - segments[i].offset : n / nsegments;
+		segments[i].stored = (const struct snapshot_choice *)
+		    (snapshot.map + offset) + segments[i].offset;
+	}
+	run_threads(snapshot_split, segments, nsegments, sizeof(*segments));
+
+	*length = hdr.length;
+	return snapshot.map + sizeof(hdr);
+}
+
+/*
+ * Turn the stored choices of the segment into choices.
+ */
+void *
+snapshot_split(void *arg)
+{
+	struct segment *s = arg;
+	const struct snapshot_choice *sc;
+	struct choice *c;
+	size_t i, length;
+
+	length = s->end - s->start;
+	sc = s->stored;
+	c = &choices.v[s->offset];
+	for (i = 0; i < s->nlines; i++, sc++, c++) {
+		if (sc->string >= length || sc->length > length - sc->string ||
+		    s->start[sc->string + sc->length] != '\0' ||
+		    sc->description > length ||
+		    sc->field_start > sc->field_end ||
+		    sc->field_end > sc->length)
+			errx(1, "invalid snapshot choice %zu", s->offset + i);
+
+		c->string = s->start + sc->string;
+		c->description = s->start + sc->description;
+		c->length = sc->length;
+		c->match_start = -1;
+		c->match_end = -1;
+		c->score = 0;
+		c->frecency = history.header != NULL ?
+		    history_frecency(c) : 0;
+		c->field_start = sc->field_start;
+		c->field_end = sc->field_end;
+	}
+
+	return NULL;
+}
+
+/*
+ * Write the choices to a snapshot at path, which is replaced atomically. The
+ * text is the input the choices refer to, excluding its NUL-terminator.
+ */
+void
+snapshot_write(const char *path, const char *text, size_t length)
+{
+	char tmp[PATH_MAX];
+	struct snapshot_header hdr;
+	struct snapshot_choice sc;
+	FILE *fh;
+	const struct choice *c;
+	size_t i, offset;
+	int fd, len;
+
+	len = snprintf(tmp, sizeof(tmp), "%s.XXXXXXXXXX", path);
+	if (len < 0 || len >= (int)sizeof(tmp))
+		errx(1, "%s: path too long", path);
+	if ((fd = mkstemp(tmp)) == -1)
+		err(1, "mkstemp: %s", tmp);
+	if ((fh = fdopen(fd, "w")) == NULL)
+		err(1, "fdopen: %s", tmp);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.flags = (choices.ascii ? SNAPSHOT_ASCII : 0) |
+	    (descriptions ? SNAPSHOT_DESCRIPTIONS : 0) |
+	    (unique ? SNAPSHOT_UNIQUE : 0) |
+	    (unique_last ? SNAPSHOT_UNIQUE_LAST : 0);
+	hdr.first = fields.first;
+	hdr.last = fields.last;
+	hdr.length = length;
+	hdr.nchoices = choices.length;
+	fwrite(&hdr, sizeof(hdr), 1, fh);
+	fwrite(text, 1, length + 1, fh);
+	offset = (sizeof(hdr) + length + 1 + sizeof(uint64_t) - 1) &
+	    ~(sizeof(uint64_t) - 1);
+	for (i = sizeof(hdr) + length + 1; i < offset; i++)
+		fputc('\0', fh);
+
+	memset(&sc, 0, sizeof(sc));
+	for (i = 0; i < choices.length; i++) {
+		c = &choices.v[i];
+		sc.string = c->string - text;
+		/* Choices lacking a description refer to the terminator. */
+		if (c->description >= text && c->description <= text + length)
+			sc.description = c->description - text;
+		else
+			sc.description = sc.string + c->length;
+		sc.length = c->length;
+		if (fields.first > 0) {
+			sc.field_start = c->field_start;
+			sc.field_end = c->field_end;
+		}
+		fwrite(&sc, sizeof(sc), 1, fh);
+	}
+
+	if (fflush(fh) == EOF || ferror(fh)) {
+		unlink(tmp);
+		err(1, "write: %s", tmp);
+	}
+	fclose(fh);
+	if (rename(tmp, path) == -1) {
+		unlink(tmp);
+		err(1, "rename: %s", path);
+	}
+}
+
+/*
+ * Read at most size bytes of input into buf. Input starting with a gzip or
+ * zstd magic number is decompressed as it's read, allowing compressed input to
+ * be loaded without holding both the compressed and decompressed data. Returns
+ * zero once all input is consumed.
+ */
+size_t
+input_read(char *buf, size_t size)
+{
+	ssize_t n;
+	size_t len;
+
+	if (source.buf == NULL)
+		input_open();
+
+	switch (source.format) {
+	case INPUT_GZIP:
+		return input_gunzip(buf, size);
+	case INPUT_ZSTD:
+		return input_unzstd(buf, size);
+	case INPUT_RAW:
+		break;
+	}
+
+	/* Hand out the input read while detecting the format first. */
+	if (source.pos < source.length) {
+		len = source.length - source.pos;
+		if (len > size)
+			len = size;
+		memcpy(buf, source.buf + source.pos, len);
+		source.pos += len;
+		return len;
+	}
+	if ((n = read(STDIN_FILENO, buf, size)) == -1)
+		err(1, "read");
+	return n;
+}
+
+/*
+ * Detect the format of the input by its magic number.
+ */
+void
+input_open(void)
+{
+	static const unsigned char gzip[] = { 0x1f, 0x8b };
+	static const unsigned char zstd[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+	source.buf = arena_alloc(&load_arena, INPUT_BUFSIZ, 1);
+	while (source.length < sizeof(zstd) && input_fill())
+		continue;
+
+	if (source.length >= sizeof(gzip) &&
+	    memcmp(source.buf, gzip, sizeof(gzip)) == 0) {
+#ifdef HAVE_ZLIB
+		source.format = INPUT_GZIP;
+		/* Only accept the gzip format, including its header. */
+		if (inflateInit2(&source.gzip, 16 + MAX_WBITS) != Z_OK)
+			errx(1, "inflateInit2: %s", source.gzip.msg != NULL ?
+			    source.gzip.msg : "failure");
+#else
+		errx(1, "gzip compressed input not supported");
+#endif
+	} else if (source.length >= sizeof(zstd) &&
+	    memcmp(source.buf, zstd, sizeof(zstd)) == 0) {
+#ifdef HAVE_ZSTD
+		source.format = INPUT_ZSTD;
+		if ((source.zstd = ZSTD_createDStream()) == NULL)
+			err(1, NULL);
+#else
+		errx(1, "zstd compressed input not supported");
+#endif
+	}
+}
+
+void
+input_close(void)
+{
+#ifdef HAVE_ZLIB
+	if (source.format == INPUT_GZIP)
+		inflateEnd(&source.gzip);
+#endif
+#ifdef HAVE_ZSTD
+	if (source.format == INPUT_ZSTD)
+		ZSTD_freeDStream(source.zstd);
+#endif
+	/* The buffer is owned by the load arena. */
+	memset(&source, 0, sizeof(source));
+}
+
+/*
+ * Read more input into the buffer, discarding the consumed input. Returns zero
+ * if no more input could be read.
+ */
+int
+input_fill(void)
+{
+	ssize_t n;
+
+	if (source.pos == source.length)
+		source.pos = source.length = 0;
+	if (source.eof || source.length == INPUT_BUFSIZ)
+		return 0;
+
+	n = read(STDIN_FILENO, source.buf + source.length,
+	    INPUT_BUFSIZ - source.length);
+	if (n == -1)
+		err(1, "read");
+	source.length += n;
+	source.eof = n == 0;
+	return n > 0;
+}
+
+size_t
+input_gunzip(char *buf, size_t size)
+{
+#ifdef HAVE_ZLIB
+	z_stream *z = &source.gzip;
+	int rc;
+
+	if (size > UINT_MAX)
+		size = UINT_MAX;
+	z->next_out = (unsigned char *)buf;
+	z->avail_out = size;
+	for (;;) {
+		/*
+		 * Concatenated gzip members are decompressed as one. Like
+		 * gzip(1), trailing data not starting with the gzip magic is
+		 * ignored and ends the input.
+		 */
+		if (source.end && source.pos + 1 == source.length)
+			input_fill();
+		if (source.end && source.pos < source.length) {
+			if (source.buf[source.pos] != 0x1f ||
+			    (source.pos + 1 < source.length &&
+			    source.buf[source.pos + 1] != 0x8b)) {
+				source.pos = source.length;
+				source.eof = 1;
+				continue;
+			}
+			if (inflateReset(z) != Z_OK)
+				errx(1, "inflateReset: failure");
+			source.end = 0;
+		}
+
+		z->next_in = source.buf + source.pos;
+		z->avail_in = source.length - source.pos;
+		rc = inflate(z, Z_NO_FLUSH);
+		source.pos = source.length - z->avail_in;
+		if (rc == Z_STREAM_END)
+			source.end = 1;
+		else if (rc != Z_OK && rc != Z_BUF_ERROR)
+			errx(1, "gzip: %s", z->msg != NULL ? z->msg :
+			    "invalid compressed input");
+
+		if (z->avail_out < size)
+			break;
+		if (!input_fill()) {
+			if (!source.end)
+				errx(1, "gzip: unexpected end of input");
+			break;
+		}
+	}
+	return size - z->avail_out;
+#else
+	(void)buf;
+	(void)size;
+	return 0;
+#endif
+}
+
+size_t
+input_unzstd(char *buf, size_t size)
+{
+#ifdef HAVE_ZSTD
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	size_t rc;
+
+	out.dst = buf;
+	out.size = size;
+	out.pos = 0;
+	for (;;) {
+		/*
+		 * Data may still be buffered by the decoder even though all
+		 * input is consumed, therefore always attempt to decompress
+		 * before reading more input.
+		 */
+		in.src = source.buf;
+		in.size = source.length;
+		in.pos = source.pos;
+		rc = ZSTD_decompressStream(source.zstd, &out, &in);
+		if (ZSTD_isError(rc))
+			errx(1, "zstd: %s", ZSTD_getErrorName(rc));
+		/*
+		 * Zero signals a completely decoded and flushed frame, unless
+		 * no progress was made in which case a new frame is expected.
+		 */
+		if (in.pos > source.pos || out.pos > 0)
+			source.end = rc == 0;
+		source.pos = in.pos;
+
+		if (out.pos > 0)
+			break;
+		if (!input_fill()) {
+			if (!source.end)
+				errx(1, "zstd: unexpected end of input");
+			break;
+		}
+	}
+	return out.pos;
+#else
+	(void)buf;
+	(void)size;
+	return 0;
+#endif
+}
+
+char *
+eager_strpbrk(const char *string, const char *separators)
+{
+	char *ptr = NULL;
+	char *tmp_ptr;
+
+	for (tmp_ptr = strpbrk(string, separators);
+	    tmp_ptr;
+	    tmp_ptr = strpbrk(tmp_ptr, separators))
+		ptr = tmp_ptr++;
+
+	return ptr;
+}
+
+const struct choice *
+selected_choice(void)
+{
+	const char *buf, *p;
+	enum key key;
+	size_t choices_count = 0;
+	size_t selection = 0;
+	size_t yscroll = 0;
+	size_t jump_length = 0;	/* length of the labels, zero unless jumping */
+	size_t jump_row = 0;
+	size_t jump_typed = 0;
+	size_t cursor_position, i, j, length;
+	int dochoices = 0;
+	int dofilter = 1;
+	int query_grew = 0;
+	int typed;
+
+	cursor_position = query_length;
+
+	for (;;) {
+		/* Scratch memory only lives for the duration of a frame. */
+		arena_reset(&frame_arena);
+
+		/*
+		 * If the user didn't add more characters to the query all
+		 * choices have to be reconsidered as potential matches.
+		 * In the opposite scenario, there's no point in reconsidered
+		 * all choices again since the ones that didn't match the
+		 * previous query will clearly not match the current one due to
+		 * the fact that previous query is a left-most substring of the
+		 * current one.
+		 */
+		if (dofilter && reload.command != NULL) {
+			/* The filtering is left to the command. */
+			reload_schedule();
+			dofilter = 0;
+			dochoices = 1;
+		} else if (dofilter) {
+			if ((dochoices = filter_choices(query_grew, 1)))
+				dofilter = selection = yscroll = 0;
+		}
+		query_grew = 0;
+
+		tty_putp(cursor_invisible, 0);
+		tty_putp(carriage_return, 1); /* move cursor to first column */
+		print_query(cursor_position);
+		if (dochoices) {
+			if (selection - yscroll >= choices_lines)
+				yscroll = selection - choices_lines + 1;
+			more_matches(yscroll + choices_lines);
+			if (yscroll + choices_lines > matches.exact)
+				refine_matches();
+			if (preview.command != NULL)
+				preview_select(matches.length > 0 ?
+				    matches.v[selection] : NULL);
+			choices_count = print_choices(yscroll, selection,
+			    jump_length);
+		}
+		tty_putp(carriage_return, 1); /* move cursor to first column */
+		for (i = j = 0; i < cursor_position; j++)
+			while (isu8cont(query[++i]))
+				continue;
+		if (j > 0)
+			/*
+			 * parm_right_cursor interprets 0 as 1, therefore only
+			 * move the cursor if the position is non zero.
+			 */
+			tty_putp(tty_parm1(parm_right_cursor, j), 1);
+		tty_putp(cursor_normal, 0);
+		fflush(tty_out);
+
+		/* Keys deferred while the command was running go first. */
+		typed = (key = reload_key()) == UNKNOWN;
+		if (typed)
+			key = get_key(&buf);
+		/* The key acts on the choices replaced while reading it. */
+		if (reload.replaced) {
+			reload.replaced = 0;
+			selection = yscroll = 0;
+			choices_count = matches.length;
+		}
+
+		/*
+		 * While jumping, the labels typed so far denote the visible
+		 * row to select. Any other key leaves the jump mode.
+		 */
+		if (jump_length > 0) {
+			if (key == PRINTABLE && buf[0] != '\0' &&
+			    buf[1] == '\0' &&
+			    (p = strchr(JUMP_LABELS, buf[0])) != NULL) {
+				jump_row = jump_row * JUMP_NLABELS +
+				    (p - JUMP_LABELS);
+				if (++jump_typed < jump_length)
+					continue;
+				if (jump_row < choices_lines &&
+				    yscroll + jump_row < matches.length)
+					return matches.v[yscroll + jump_row];
+			}
+			jump_length = 0;
+			if (key == PRINTABLE)
+				continue;
+		}
+
+		switch (key) {
+		case ENTER:
+		case JUMP:
+		case LINE_DOWN:
+		case LINE_UP:
+		case PAGE_DOWN:
+		case PAGE_UP:
+		case END:
+		case HOME:
+			/*
+			 * The filtering could have been aborted by input not
+			 * yet handled. Ensure keys operating on the matches
+			 * reflects the current query.
+			 */
+			if (dofilter) {
+				filter_choices(1, 0);
+				choices_count = matches.length;
+				dofilter = selection = yscroll = 0;
+				dochoices = 1;
+			}
+			/*
+			 * Unless jumping, the key is deferred until the output
+			 * of the command reflects the current query. The jump
+			 * labels refer to the choices currently displayed.
+			 */
+			if (typed && key != JUMP && reload.command != NULL &&
+			    reload_defer(key))
+				key = UNKNOWN;
+			break;
+		default:
+			break;
+		}
+
+		switch (key) {
+		case ENTER:
+			more_matches(selection + 1);
+			if (matches.length > selection)
+				return matches.v[selection];
+			break;
 		case ALT_ENTER:
 			choices.v[choices.length].string = query;
 			choices.v[choices.length].description = "";
+			choices.v[choices.length].length = query_length;
 			return &choices.v[choices.length];
 		case CTRL_C:
 			return NULL;
 		case CTRL_Z:
 			tty_restore(0);
+			/*
+			 * Let the default action of SIGTSTP suspend the
+			 * process. The SIGCONT received once resumed causes a
+			 * redraw.
+			 */
+			signal_action(SIGTSTP, SIG_DFL);
 			kill(getpid(), SIGTSTP);
+			signal_action(SIGTSTP, handle_signal);
 			tty_init(0);
 			break;
 		case BACKSPACE:
@@ -378,6 +2540,8 @@ selected_choice(void)
 			break;
 		case CTRL_L:
 			tty_size();
+			/* The cached previews could be truncated. */
+			preview_clear();
 			break;
 		case CTRL_O:
 			sort = !sort;
@@ -411,6 +2575,8 @@ selected_choice(void)
 			cursor_position = query_length;
 			break;
 		case LINE_DOWN:
+			more_matches(selection + 2);
+			choices_count = matches.length;
 			if (selection < choices_count - 1) {
 				selection++;
 				if (selection - yscroll == choices_lines)
@@ -435,6 +2601,8 @@ selected_choice(void)
 				continue;
 			break;
 		case PAGE_DOWN:
+			more_matches(selection + choices_lines + 1);
+			choices_count = matches.length;
 			if (selection + choices_lines < choices_count)
 				yscroll = selection += choices_lines;
 			else
@@ -447,12 +2615,27 @@ selected_choice(void)
 				yscroll = selection = 0;
 			break;
 		case END:
+			more_matches(SIZE_MAX);
+			choices_count = matches.length;
 			if (choices_count > 0)
 				selection = choices_count - 1;
 			break;
 		case HOME:
 			yscroll = selection = 0;
 			break;
+		case JUMP:
+			more_matches(yscroll + choices_lines);
+			if (matches.length <= yscroll)
+				break;
+			length = matches.length - yscroll;
+			if (length > choices_lines)
+				length = choices_lines;
+			/* Every label has the same length. */
+			for (i = JUMP_NLABELS, jump_length = 1; i < length;
+			    i *= JUMP_NLABELS)
+				jump_length++;
+			jump_row = jump_typed = 0;
+			break;
 		case PRINTABLE:
 			length = strlen(buf);
 
@@ -475,6 +2658,7 @@ selected_choice(void)
 			query[query_length] = '\0';
 			dofilter = query_grew = 1;
 			break;
+		case REDRAW:
 		case UNKNOWN:
 			break;
 		}
@@ -482,53 +2666,734 @@ selected_choice(void)
 }
 
 /*
- * Filter the first nchoices number of choices using the current query and
- * regularly check for new user input in order to abort filtering. This
- * improves the performance when the cardinality of the choices is large.
+ * Filter the choices using the current query and if interruptible is non-zero,
+ * regularly check for new user input in order to abort filtering. This improves
+ * the performance when the cardinality of the choices is large. If grew is
+ * non-zero, only the matches from the previous filtering are reconsidered,
+ * given that they include all choices matching the previous query. While not
+ * sorting, the filtering stops once the lines available to the choices are
+ * filled as the matches remain in input order, the rest is filtered on demand
+ * by more_matches().
+ * Returns non-zero if the filtering was not aborted.
+ */
+int
+filter_choices(int grew, int interruptible)
+{
+	grew = query_compile() && grew && matches.complete &&
+	    matches.next == matches.ncandidates;
+	matches.ncandidates = grew ? matches.length : choices.length;
+	matches.next = 0;
+	matches.grew = grew;
+	matches.length = matches.count = 0;
+	matches.complete = 1;
+
+	return scan_choices(sort ? SIZE_MAX : choices_lines, interruptible);
+}
+
+/*
+ * Ensure that at least n matches are found, unless fewer choices match the
+ * query, by filtering the choices not yet visited.
+ */
+void
+more_matches(size_t n)
+{
+	if (matches.length < n && matches.next < matches.ncandidates)
+		scan_choices(n, 0);
+}
+
+/*
+ * Visit the choices not yet visited while filtering, see filter_choices(),
+ * until limit number of matches are found.
  * Returns non-zero if the filtering was not aborted.
  */
 int
-filter_choices(size_t nchoices)
+scan_choices(size_t limit, int interruptible)
 {
 	struct choice *c;
-	struct pollfd pfd;
-	size_t i, match_length;
-	int nready;
+	double *best;
+	size_t count, i, k, n, nbest, nmatches;
+	int complete, dropped, parallel;
+	int grew = matches.grew;
+	int skipped = 0;
+
+	n = matches.ncandidates;
+	nmatches = matches.length;
+	count = matches.count;
+	complete = matches.complete;
+	dropped = 0;
 
-	for (i = 0; i < nchoices; i++) {
-		c = &choices.v[i];
-		if (min_match(c->string, 0,
-		    &c->match_start, &c->match_end) == INT_MAX) {
-			c->match_start = c->match_end = -1;
-			c->score = 0;
-		} else if (!sort) {
-			c->score = 1;
-		} else {
-			match_length = c->match_end - c->match_start;
-			c->score = (double)query_length/match_length/c->length;
+	/*
+	 * While sorting fuzzy matches, the k best scores seen so far are kept.
+	 * A choice whose score is bounded below the worst of them, given that
+	 * no match is shorter than one byte per character, cannot end up
+	 * among the first k matches. Any match of such choice is therefore
+	 * good enough, leaving the shortest one to refine_matches().
+	 */
+	k = nbest = 0;
+	if (sort && matcher.mode == MATCH_FUZZY && query_length > 0)
+		k = maxmatches > choices_lines ? maxmatches : choices_lines;
+	best = arena_alloc(&frame_arena, k, sizeof(*best));
+
+	/*
+	 * Unless the scan is bounded, the choices are first matched in
+	 * parallel. What remains is to collect the matches in order.
+	 */
+	parallel = nthreads > 1 && limit == SIZE_MAX &&
+	    n - matches.next >= SCAN_MIN;
+	if (parallel) {
+		if (!scan_parallel(n, k, interruptible, &skipped)) {
+			scan_interrupt(nmatches, count, matches.next, n);
+			return 0;
 		}
+	}
 
-		if (i > 0 && i % 50 == 0) {
-			pfd.fd = fileno(tty_in);
-			pfd.events = POLLIN;
-			if ((nready = poll(&pfd, 1, 0)) == -1)
-				err(1, "poll");
-			if (nready == 1 && pfd.revents & (POLLIN | POLLHUP))
-				return 0;
+	for (i = matches.next; i < n && nmatches < limit; i++) {
+		/*
+		 * Matches are compacted in place, which is safe since at most
+		 * the already visited elements are overwritten.
+		 */
+		c = grew ? matches.v[i] : &choices.v[i];
+		if (parallel) {
+			/* An empty query is matched by all choices. */
+			if (query_length > 0 && c->match_start == -1)
+				continue;
+		} else if (!visit_choice(c, best, &nbest, k, &skipped)) {
+			goto next;
+		}
+		add_match(c, &nmatches, &complete);
+		count++;
+
+		/*
+		 * Once the bounded matches are exhausted while not sorting,
+		 * any subsequent choice in input order would be dropped.
+		 */
+		if (!complete && !sort && !grew) {
+			dropped = i + 1 < n;
+			n = i + 1;
+		}
+
+next:
+		if (interruptible && !parallel && i > 0 && i % 50 == 0 &&
+		    tty_pending()) {
+			scan_interrupt(nmatches, count, i + 1, n);
+			return 0;
 		}
 	}
-	qsort(choices.v, nchoices, sizeof(struct choice), choicecmp);
+	matches.length = nmatches;
+	matches.count = count;
+	matches.next = i;
+	matches.ncandidates = n;
+	/*
+	 * Any choice not visited, either due to the bounded matches or not yet
+	 * being filtered, is not counted.
+	 */
+	matches.partial = dropped || i < n;
+	matches.complete = complete;
+	matches.exact = skipped && k < nmatches ? k : nmatches;
+	/* Unless sorting, the matches are already in input order. */
+	if (sort)
+		sort_matches(0);
+
+	return 1;
+}
+
+/*
+ * Abort the scan, see scan_choices(), while preserving the matches not yet
+ * visited starting at next as they still include all choices matching the
+ * query.
+ */
+void
+scan_interrupt(size_t nmatches, size_t count, size_t next, size_t n)
+{
+	if (matches.grew) {
+		memmove(matches.v + nmatches, matches.v + next,
+		    (n - next) * sizeof(*matches.v));
+		matches.length = nmatches + n - next;
+	} else {
+		matches.length = nmatches;
+		matches.complete = 0;
+	}
+	matches.count = count;
+	matches.partial = 1;
+	matches.exact = 0;
+	matches.next = matches.ncandidates = 0;
+}
+
+/*
+ * Match the choice while filtering. The k best scores seen so far are kept in
+ * best, see scan_choices(). If a choice only matched greedily, skipped is set.
+ * Returns non-zero if the choice is a match. A choice not matching is given a
+ * match start of -1.
+ */
+int
+visit_choice(struct choice *c, double *best, size_t *nbest, size_t k,
+    int *skipped)
+{
+	int greedy;
+
+	greedy = k > 0 && *nbest == k && c->length > 0 &&
+	    matcher.nchars > 0 &&
+	    (double)query_length / matcher.nchars / c->length *
+	    (1 + c->frecency) < best[0];
+	if (!match_choice(c, greedy)) {
+		c->match_start = c->match_end = -1;
+		/*
+		 * An empty query is matched by all choices, favoring the ones
+		 * frequently and recently selected.
+		 */
+		c->score = sort ? c->frecency : 0;
+		return query_length == 0;
+	}
 
+	score_match(c);
+	if (greedy)
+		*skipped = 1;
+	else if (k > 0)
+		add_score(best, nbest, k, c->score);
 	return 1;
 }
 
+/*
+ * Match the candidates starting at the next one to visit up to n in parallel,
+ * see scan_choices(). Each thread starts out visiting its own range of the
+ * candidates, chunk by chunk, and then steals chunks from the end of the ranges
+ * of other threads. Each thread keeps its own k best scores which is
+ * conservative as they are never better than the overall ones. Returns zero if
+ * the scan was interrupted.
+ */
+int
+scan_parallel(size_t n, size_t k, int interruptible, int *skipped)
+{
+	struct scan_range *scans;
+	struct choice *c;
+	size_t i, length, m, nscans;
+	int error;
+
+	/*
+	 * Size the chunks such that the choices visited at once, along with
+	 * their strings, fit in the L2 cache. The length of the strings is
+	 * estimated from the first candidates.
+	 */
+	if (cachesize == 0) {
+#ifdef _SC_LEVEL2_CACHE_SIZE
+		cachesize = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+		if (cachesize <= 0)
+			cachesize = SCAN_CACHE;
+	}
+	m = n - matches.next;
+	for (i = length = 0; i < m && i < 64; i++) {
+		c = matches.grew ?
+		    matches.v[matches.next + i] : &choices.v[matches.next + i];
+		length += c->length;
+	}
+	scan.chunk = cachesize / (sizeof(*c) + length / i);
+	if (scan.chunk < 16)
+		scan.chunk = 16;
+
+	nscans = m / scan.chunk + 1;
+	if (nscans > nthreads)
+		nscans = nthreads;
+	scans = arena_alloc(&frame_arena, nscans, sizeof(*scans));
+	for (i = 0; i < nscans; i++) {
+		if ((error = pthread_mutex_init(&scans[i].lock, NULL)))
+			errx(1, "pthread_mutex_init: %s", strerror(error));
+		scans[i].next = matches.next + m / nscans * i;
+		scans[i].end = i + 1 == nscans ?
+		    n : matches.next + m / nscans * (i + 1);
+		scans[i].best = arena_alloc(&frame_arena, k,
+		    sizeof(*scans[i].best));
+		scans[i].nbest = 0;
+		scans[i].skipped = 0;
+	}
+	scan.v = scans;
+	scan.n = nscans;
+	scan.k = k;
+	scan.interruptible = interruptible;
+	scan.interrupted = 0;
+	run_threads(scan_run, scans, nscans, sizeof(*scans));
+
+	for (i = 0; i < nscans; i++) {
+		*skipped |= scans[i].skipped;
+		pthread_mutex_destroy(&scans[i].lock);
+	}
+	return !scan.interrupted;
+}
+
+/*
+ * Visit the candidates of the range given by arg, see scan_parallel().
+ */
+void *
+scan_run(void *arg)
+{
+	struct scan_range *s = arg;
+	struct choice *c;
+	size_t i, j, end, start;
+
+	for (;;) {
+		if (!scan_take(s, 0, &start, &end)) {
+			for (i = 1, j = s - scan.v; i < scan.n; i++)
+				if (scan_take(&scan.v[(j + i) % scan.n], 1,
+				    &start, &end))
+					break;
+			if (i == scan.n)
+				break;
+		}
+
+		for (i = start; i < end; i++) {
+			c = matches.grew ? matches.v[i] : &choices.v[i];
+			visit_choice(c, s->best, &s->nbest, scan.k,
+			    &s->skipped);
+		}
+
+		/* Only the main thread may read from the tty. */
+		if (s == scan.v && scan.interruptible && tty_pending()) {
+			for (i = 0; i < scan.n; i++) {
+				pthread_mutex_lock(&scan.v[i].lock);
+				scan.v[i].end = scan.v[i].next;
+				pthread_mutex_unlock(&scan.v[i].lock);
+			}
+			scan.interrupted = 1;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Take a chunk of the candidates left to visit in the range of s, either from
+ * the beginning or the end of the range. Returns zero if the range is
+ * exhausted, the chunk is then empty.
+ */
+int
+scan_take(struct scan_range *s, int end, size_t *start, size_t *stop)
+{
+	int taken;
+
+	pthread_mutex_lock(&s->lock);
+	*start = *stop = s->next;
+	if ((taken = s->next < s->end)) {
+		if (end) {
+			*stop = s->end;
+			*start = s->end - s->next > scan.chunk ?
+			    s->end - scan.chunk : s->next;
+			s->end = *start;
+		} else {
+			*stop = s->end - s->next > scan.chunk ?
+			    s->next + scan.chunk : s->end;
+			s->next = *stop;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return taken;
+}
+
+/*
+ * Find the shortest match of the matches not refined while filtering, see
+ * filter_choices(), and sort them again. Since they rank below the refined
+ * ones regardless, only the unrefined part needs to be sorted.
+ */
+void
+refine_matches(void)
+{
+	struct choice *c;
+	size_t i;
+
+	if (matches.exact == matches.length)
+		return;
+
+	for (i = matches.exact; i < matches.length; i++) {
+		c = matches.v[i];
+		if (match_choice(c, 0))
+			score_match(c);
+	}
+	sort_matches(matches.exact);
+	matches.exact = matches.length;
+}
+
+/*
+ * Score the choice matching the query.
+ */
+void
+score_match(struct choice *c)
+{
+	size_t match_length;
+
+	if (!sort) {
+		c->score = 1;
+	} else if (matcher.mode == MATCH_FUZZY) {
+		match_length = c->match_end - c->match_start;
+		c->score = (double)query_length/match_length/c->length;
+		c->score *= 1 + c->frecency;
+	} else {
+		/* Favor the shortest choices matching the pattern. */
+		c->score = 1.0 / (c->length + 1);
+		c->score *= 1 + c->frecency;
+	}
+}
+
+/*
+ * Add the choice to the matches. If the number of matches is bounded while
+ * sorting, the matches are kept as a heap with the worst ranked match at the
+ * root which is evicted in favor of better ranked choices. Once a choice is
+ * dropped, complete is set to zero.
+ */
+void
+add_match(struct choice *c, size_t *nmatches, int *complete)
+{
+	struct choice **v = matches.v;
+	struct choice *tmp;
+	size_t child, i, n;
+
+	n = *nmatches;
+	if (!sort) {
+		/* Unless sorting, the matches are kept in input order. */
+		if (n < matches.size)
+			v[(*nmatches)++] = c;
+		else
+			*complete = 0;
+		return;
+	}
+	if (n < matches.size) {
+		for (v[n] = c, i = n; i > 0; i = (i - 1) / 2) {
+			if (choicecmp(&v[i], &v[(i - 1) / 2]) <= 0)
+				break;
+			tmp = v[i];
+			v[i] = v[(i - 1) / 2];
+			v[(i - 1) / 2] = tmp;
+		}
+		*nmatches = n + 1;
+		return;
+	}
+
+	*complete = 0;
+	if (n == 0 || choicecmp(&c, &v[0]) >= 0)
+		return;
+
+	for (v[0] = c, i = 0; (child = 2 * i + 1) < n; i = child) {
+		if (child + 1 < n && choicecmp(&v[child + 1], &v[child]) > 0)
+			child++;
+		if (choicecmp(&v[child], &v[i]) <= 0)
+			break;
+		tmp = v[i];
+		v[i] = v[child];
+		v[child] = tmp;
+	}
+}
+
+/*
+ * Add the score to the k best scores, kept as a heap with the worst score at
+ * the root.
+ */
+void
+add_score(double *v, size_t *n, size_t k, double score)
+{
+	double tmp;
+	size_t child, i;
+
+	if (*n < k) {
+		for (v[*n] = score, i = (*n)++; i > 0; i = (i - 1) / 2) {
+			if (v[i] >= v[(i - 1) / 2])
+				break;
+			tmp = v[i];
+			v[i] = v[(i - 1) / 2];
+			v[(i - 1) / 2] = tmp;
+		}
+		return;
+	}
+	if (score <= v[0])
+		return;
+
+	for (v[0] = score, i = 0; (child = 2 * i + 1) < k; i = child) {
+		if (child + 1 < k && v[child + 1] < v[child])
+			child++;
+		if (v[child] >= v[i])
+			break;
+		tmp = v[i];
+		v[i] = v[child];
+		v[child] = tmp;
+	}
+}
+
+/*
+ * Allocate memory for an array of nmemb elements of size bytes from the arena.
+ * The memory remains valid until the arena is reset or freed.
+ */
+void *
+arena_alloc(struct arena *a, size_t nmemb, size_t size)
+{
+	struct arena_chunk *c;
+	size_t n;
+
+	if (nmemb > 0 && size > (SIZE_MAX - ARENA_ALIGN) / nmemb) {
+		errno = ENOMEM;
+		err(1, NULL);
+	}
+	n = (nmemb * size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	if ((c = a->chunks) == NULL || c->size - c->length < n) {
+		size = a->size > ARENA_CHUNK ? a->size : ARENA_CHUNK;
+		if (size < n)
+			size = n;
+		if ((c = malloc(ARENA_HEADER + size)) == NULL)
+			err(1, NULL);
+		c->next = a->chunks;
+		c->size = size;
+		c->length = 0;
+		a->chunks = c;
+		a->size += size;
+	}
+
+	c->length += n;
+	return (char *)c + ARENA_HEADER + c->length - n;
+}
+
+/*
+ * Release all memory handed out by the arena. If more than one chunk was
+ * needed, they are replaced by a single chunk large enough to hold all of them,
+ * causing subsequent use of similar size to not allocate any memory.
+ */
+void
+arena_reset(struct arena *a)
+{
+	struct arena_chunk *c;
+	size_t size;
+
+	if (a->chunks != NULL && a->chunks->next != NULL) {
+		size = a->size;
+		arena_free(a);
+		if ((c = malloc(ARENA_HEADER + size)) == NULL)
+			err(1, NULL);
+		c->next = NULL;
+		c->size = size;
+		a->chunks = c;
+		a->size = size;
+	}
+	if (a->chunks != NULL)
+		a->chunks->length = 0;
+}
+
+void
+arena_free(struct arena *a)
+{
+	struct arena_chunk *c, *next;
+
+	for (c = a->chunks; c != NULL; c = next) {
+		next = c->next;
+		free(c);
+	}
+	a->chunks = NULL;
+	a->size = 0;
+}
+
+/*
+ * Sort the matches starting at offset by score using a parallel merge sort. The
+ * matches are first turned into ranks, keeping the score next to the choice in
+ * order to avoid chasing pointers while comparing. The ranks are divided into
+ * runs sorted by one thread each, followed by merging adjacent runs pairwise.
+ * Each merge is in turn divided among the available threads.
+ */
+void
+sort_matches(size_t offset)
+{
+	struct merge *merges;
+	struct run *runs;
+	struct rank *ranks, *swap, *tmp;
+	struct choice **v;
+	size_t *bounds;
+	size_t i, k, n, na, nb, nmerges, nparts, nruns, p;
+
+	v = matches.v + offset;
+	n = matches.length - offset;
+	ranks = arena_alloc(&frame_arena, n + 1, sizeof(*ranks));
+	tmp = arena_alloc(&frame_arena, n + 1, sizeof(*tmp));
+	for (i = 0; i < n; i++) {
+		ranks[i].score = v[i]->score;
+		ranks[i].choice = v[i];
+	}
+
+	nruns = n / SORT_MIN + 1;
+	if (nruns > nthreads)
+		nruns = nthreads;
+	runs = arena_alloc(&frame_arena, nruns, sizeof(*runs));
+	bounds = arena_alloc(&frame_arena, nruns + 1, sizeof(*bounds));
+	merges = arena_alloc(&frame_arena, nthreads, sizeof(*merges));
+	for (i = 0; i <= nruns; i++)
+		bounds[i] = n / nruns * i + (i == nruns ? n % nruns : 0);
+	for (i = 0; i < nruns; i++) {
+		runs[i].v = ranks + bounds[i];
+		runs[i].tmp = tmp + bounds[i];
+		runs[i].n = bounds[i + 1] - bounds[i];
+	}
+	run_threads(sort_run, runs, nruns, sizeof(*runs));
+
+	while (nruns > 1) {
+		/*
+		 * Each pair of runs is merged by nparts number of threads,
+		 * where each thread produces a distinct part of the output.
+		 * A trailing run without a pair is merged with an empty run.
+		 */
+		nparts = nthreads / ((nruns + 1) / 2);
+		if (nparts == 0)
+			nparts = 1;
+		for (nmerges = 0, i = 0; i < nruns; i += 2) {
+			na = bounds[i + 1] - bounds[i];
+			nb = i + 1 < nruns ? bounds[i + 2] - bounds[i + 1] : 0;
+			for (p = 0; p < nparts; p++) {
+				merges[nmerges].a = ranks + bounds[i];
+				merges[nmerges].na = na;
+				merges[nmerges].b = ranks + bounds[i] + na;
+				merges[nmerges].nb = nb;
+				merges[nmerges].out = tmp + bounds[i];
+				merges[nmerges].start = (na + nb) / nparts * p;
+				merges[nmerges].end = p + 1 == nparts ?
+				    na + nb : (na + nb) / nparts * (p + 1);
+				nmerges++;
+			}
+		}
+		run_threads(merge_runs, merges, nmerges, sizeof(*merges));
+
+		for (i = 0, k = 0; i <= nruns; i += 2)
+			bounds[k++] = bounds[i];
+		if (nruns % 2 == 1)
+			bounds[k++] = bounds[nruns];
+		nruns = k - 1;
+		swap = ranks;
+		ranks = tmp;
+		tmp = swap;
+	}
+
+	for (i = 0; i < n; i++)
+		v[i] = ranks[i].choice;
+}
+
+void *
+sort_run(void *arg)
+{
+	struct run *r = arg;
+	struct rank *dst, *src, *swap;
+	struct rank x;
+	size_t hi, i, j, lo, mid, width;
+
+	/* Start off by sorting small runs using insertion sort. */
+	for (lo = 0; lo < r->n; lo += SORT_WIDTH) {
+		hi = lo + SORT_WIDTH < r->n ? lo + SORT_WIDTH : r->n;
+		for (i = lo + 1; i < hi; i++) {
+			x = r->v[i];
+			for (j = i; j > lo && rankcmp(&x, &r->v[j - 1]) < 0;
+			    j--)
+				r->v[j] = r->v[j - 1];
+			r->v[j] = x;
+		}
+	}
+
+	src = r->v;
+	dst = r->tmp;
+	for (width = SORT_WIDTH; width < r->n; width *= 2) {
+		for (lo = 0; lo < r->n; lo += 2 * width) {
+			mid = lo + width < r->n ? lo + width : r->n;
+			hi = lo + 2 * width < r->n ? lo + 2 * width : r->n;
+			merge(src + lo, mid - lo, src + mid, hi - mid,
+			    dst + lo);
+		}
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+	if (src != r->v)
+		memcpy(r->v, src, r->n * sizeof(*src));
+
+	return NULL;
+}
+
+/*
+ * Merge the part of the two runs ending up between the start and end offsets
+ * of the output.
+ */
+void *
+merge_runs(void *arg)
+{
+	const struct merge *m = arg;
+	size_t i, j;
+
+	i = merge_split(m->a, m->na, m->b, m->nb, m->start);
+	j = merge_split(m->a, m->na, m->b, m->nb, m->end);
+	merge(m->a + i, j - i, m->b + m->start - i,
+	    (m->end - j) - (m->start - i), m->out + m->start);
+
+	return NULL;
+}
+
+/*
+ * Returns the number of elements from the first run among the first k elements
+ * of the merged output.
+ */
+size_t
+merge_split(const struct rank *a, size_t na, const struct rank *b, size_t nb,
+    size_t k)
+{
+	size_t hi, i, lo;
+
+	lo = k > nb ? k - nb : 0;
+	hi = k < na ? k : na;
+	while (lo < hi) {
+		i = lo + (hi - lo) / 2;
+		if (rankcmp(&a[i], &b[k - i - 1]) < 0)
+			lo = i + 1;
+		else
+			hi = i;
+	}
+
+	return lo;
+}
+
+void
+merge(const struct rank *a, size_t na, const struct rank *b, size_t nb,
+    struct rank *out)
+{
+	const struct rank *aend = a + na;
+	const struct rank *bend = b + nb;
+
+	while (a < aend && b < bend) {
+		if (rankcmp(b, a) < 0)
+			*out++ = *b++;
+		else
+			*out++ = *a++;
+	}
+	while (a < aend)
+		*out++ = *a++;
+	while (b < bend)
+		*out++ = *b++;
+}
+
+int
+rankcmp(const struct rank *r1, const struct rank *r2)
+{
+	if (r1->score < r2->score)
+		return 1;
+	if (r1->score > r2->score)
+		return -1;
+	/*
+	 * The two choices have an equal score.
+	 * Since the choices are never reordered, the address of the choice
+	 * reflects the initial input order.
+	 */
+	if (r1->choice < r2->choice)
+		return -1;
+	if (r1->choice > r2->choice)
+		return 1;
+	return 0;
+}
+
 int
 choicecmp(const void *p1, const void *p2)
 {
 	const struct choice *c1, *c2;
 
-	c1 = p1;
-	c2 = p2;
+	c1 = *(const struct choice * const *)p1;
+	c2 = *(const struct choice * const *)p2;
 	if (c1->score < c2->score)
 		return 1;
 	if (c1->score > c2->score)
@@ -547,42 +3412,508 @@ choicecmp(const void *p1, const void *p2)
 	return 0;
 }
 
-size_t
-min_match(const char *string, size_t offset, ssize_t *start, ssize_t *end)
+/*
+ * Compile the query into a matcher, unless the query is unchanged. By default,
+ * the query is matched fuzzy. The following operators instead causes the rest
+ * of the query to be matched as a literal or regular expression:
+ *
+ *	'exact		substring
+ *	^prefix		prefix
+ *	suffix$		suffix
+ *	/regex/		extended regular expression
+ *
+ * Case is disregarded unless smart-case is enabled and the query contains an
+ * uppercase character, or case-sensitive matching is enabled.
+ *
+ * Returns non-zero if all choices matching the current query also match the
+ * previous one, given that characters were only added to the query.
+ */
+int
+query_compile(void)
+{
+	enum match_mode mode = MATCH_FUZZY;
+	const char *start = query;
+	char *pattern;
+	wchar_t wc;
+	size_t i, length = query_length;
+	int c, icase, n, refined;
+
+	if (matcher.query != NULL && strcmp(matcher.query, query) == 0)
+		return 1;
+
+	/* In a single-byte locale, all characters are folded bytewise. */
+	if (fold['a'] == 0)
+		for (i = 0; i < 256; i++) {
+			same[i] = i;
+			if (MB_CUR_MAX == 1)
+				fold[i] = tolower(i);
+			else
+				fold[i] = i >= 'A' && i <= 'Z' ?
+				    i - 'A' + 'a' : i;
+		}
+
+	if (query_length > 2 && query[0] == '/' &&
+	    query[query_length - 1] == '/') {
+		mode = MATCH_REGEX;
+		start++;
+		length -= 2;
+	} else if (query_length > 1 && query[0] == '\'') {
+		mode = MATCH_EXACT;
+		start++;
+		length--;
+	} else if (query_length > 1 && query[0] == '^') {
+		mode = MATCH_PREFIX;
+		start++;
+		length--;
+	} else if (query_length > 1 && query[query_length - 1] == '$') {
+		mode = MATCH_SUFFIX;
+		length--;
+	}
+
+	icase = casing != CASE_SENSITIVE;
+	for (i = 0; casing == CASE_SMART && i < length; i += n) {
+		if ((n = xmbtowc(&wc, start + i)) == 0)
+			n = 1;
+		else if (iswupper(wc))
+			icase = 0;
+	}
+
+	if (matcher.mode == MATCH_REGEX && !matcher.error)
+		regfree(&matcher.regex);
+	pattern = arena_alloc(&frame_arena, length + 1, 1);
+	memcpy(pattern, start, length);
+	pattern[length] = '\0';
+	if (mode != MATCH_REGEX && icase)
+		for (i = 0; i < length; i++)
+			pattern[i] = fold[(unsigned char)pattern[i]];
+
+	/*
+	 * The fuzzy query is refined as long as characters are added. A literal
+	 * is refined as long as the previous one remains a substring, prefix or
+	 * suffix of it respectively. A query matched with respect to case
+	 * refines one disregarding case, but not the other way around.
+	 */
+	refined = mode == matcher.mode && length >= matcher.length &&
+	    (matcher.icase || !icase);
+	switch (refined ? mode : MATCH_REGEX) {
+	case MATCH_FUZZY:
+		break;
+	case MATCH_EXACT:
+		refined = strstr(pattern, matcher.pattern) != NULL;
+		break;
+	case MATCH_PREFIX:
+		refined = memcmp(pattern, matcher.pattern, matcher.length) == 0;
+		break;
+	case MATCH_SUFFIX:
+		refined = memcmp(pattern + length - matcher.length,
+		    matcher.pattern, matcher.length) == 0;
+		break;
+	case MATCH_REGEX:
+		refined = 0;
+		break;
+	}
+
+	/* The buffers are only grown along with the query. */
+	if (matcher.size < query_length + 1) {
+		matcher.size = query_size > query_length ?
+		    query_size : query_length + 1;
+		if ((matcher.query = realloc(matcher.query,
+		    matcher.size)) == NULL ||
+		    (matcher.pattern = realloc(matcher.pattern,
+		    matcher.size)) == NULL ||
+		    (matcher.sets = reallocarray(matcher.sets, matcher.size,
+		    sizeof(*matcher.sets))) == NULL)
+			err(1, NULL);
+	}
+	memcpy(matcher.query, query, query_length + 1);
+	memcpy(matcher.pattern, pattern, length + 1);
+	pattern = matcher.pattern;
+	matcher.mode = mode;
+	matcher.length = length;
+	matcher.icase = icase;
+	matcher.fold = icase ? fold : same;
+	matcher.error = 0;
+
+	if (mode == MATCH_REGEX) {
+		matcher.error = regcomp(&matcher.regex, pattern,
+		    REG_EXTENDED | (icase ? REG_ICASE : 0)) != 0;
+		return refined;
+	}
+
+	/* In a single-byte locale, all characters are treated as ASCII. */
+	matcher.ascii = 1;
+	for (i = 0; i < length && MB_CUR_MAX > 1; i++)
+		if ((unsigned char)pattern[i] >= 0x80)
+			matcher.ascii = 0;
+
+	if (mode == MATCH_FUZZY) {
+		/* No fuzzy match is shorter than one byte per character. */
+		for (i = 0, matcher.nchars = 0; i < query_length; i++)
+			matcher.nchars += !isu8cont(query[i]);
+
+		/*
+		 * An ASCII query can be matched bytewise, unless case is
+		 * disregarded and non-ASCII characters, such as the Kelvin
+		 * sign, could fold into ASCII ones. Each character is then
+		 * searched for as a set of bytes, see strbytechr().
+		 */
+		matcher.bytewise = matcher.ascii &&
+		    (MB_CUR_MAX == 1 || choices.ascii || !icase);
+		for (i = 0; matcher.bytewise && i < length; i++) {
+			c = (unsigned char)pattern[i];
+			n = 0;
+			matcher.sets[i][n++] = c;
+			if (icase && toupper(c) != c)
+				matcher.sets[i][n++] = toupper(c);
+			if (c != '\033')
+				matcher.sets[i][n++] = '\033';
+			matcher.sets[i][n] = '\0';
+		}
+		return refined;
+	}
+
+	/*
+	 * A literal consisting of ASCII only is searched for bytewise using
+	 * Boyer-Moore-Horspool, see horspool().
+	 */
+	for (i = 0; i < 256; i++)
+		matcher.skip[i] = length;
+	for (i = 0; i + 1 < length; i++)
+		matcher.skip[(unsigned char)pattern[i]] = length - i - 1;
+
+	return refined;
+}
+
+/*
+ * Returns the spans of the matched characters of the choice, allocated from the
+ * frame arena. A fuzzy match is retraced from its start by matching each
+ * character as early as possible, ending where the match ends. Only done for
+ * visible choices.
+ */
+struct span *
+match_spans(const struct choice *c, size_t *nspans)
+{
+	struct span *spans;
+	const char *end, *q, *s;
+	wchar_t wc;
+	size_t i, n, nchars;
+
+	*nspans = 0;
+	if (c->match_start < 0 || c->match_end <= c->match_start)
+		return NULL;
+
+	if (matcher.mode != MATCH_FUZZY) {
+		spans = arena_alloc(&frame_arena, 1, sizeof(*spans));
+		spans->start = c->match_start;
+		spans->end = c->match_end;
+		*nspans = 1;
+		return spans;
+	}
+
+	nchars = matcher.bytewise ? matcher.length : matcher.nchars;
+	spans = arena_alloc(&frame_arena, nchars, sizeof(*spans));
+	s = c->string + c->match_start;
+	end = c->string + c->match_end;
+	q = query;
+	for (i = 0; i < nchars; i++) {
+		if (matcher.bytewise) {
+			s = strbytechr(s, end, matcher.sets[i]);
+			n = 1;
+		} else {
+			s = strcasechr(s, end, q);
+			q += xmbtowc(&wc, q);
+			n = s != NULL ? xmbtowc(&wc, s) : 0;
+		}
+		if (s == NULL)
+			break;
+
+		/* Adjacent characters are merged into the same span. */
+		if (*nspans > 0 &&
+		    spans[*nspans - 1].end == (size_t)(s - c->string)) {
+			spans[*nspans - 1].end += n;
+		} else {
+			spans[*nspans].start = s - c->string;
+			spans[*nspans].end = s - c->string + n;
+			(*nspans)++;
+		}
+		s += n;
+	}
+
+	return spans;
+}
+
+/*
+ * Returns non-zero if the choice matches the compiled query, see
+ * query_compile(). The offsets of the match are stored in the choice. If
+ * fields are selected, only the corresponding span of the choice is matched.
+ * If greedy is non-zero, any fuzzy match suffices instead of the shortest one.
+ */
+int
+match_choice(struct choice *c, int greedy)
 {
-	const char *e, *q, *s;
 	size_t length;
+	int matched;
+
+	length = descriptions ? strlen(c->string) : c->length;
+	if (fields.first == 0)
+		return query_match(c->string, length,
+		    &c->match_start, &c->match_end, greedy);
+
+	matched = query_match(c->string + c->field_start,
+	    c->field_end - c->field_start, &c->match_start, &c->match_end,
+	    greedy);
+	if (matched) {
+		c->match_start += c->field_start;
+		c->match_end += c->field_start;
+	}
+
+	return matched;
+}
+
+/*
+ * Returns non-zero if the string of the given length matches the compiled
+ * query, see query_compile(). The string is not required to be NUL-terminated
+ * at the given length, but must be NUL-terminated further on. The offsets of
+ * the match are stored in start and end. See match_choice() regarding greedy.
+ */
+int
+query_match(const char *string, size_t length, ssize_t *start, ssize_t *end,
+    int greedy)
+{
+	const char *e, *s, *t;
+	const char *stop = string + length;
+	regmatch_t rm;
+	size_t n;
+
+	switch (matcher.mode) {
+	case MATCH_FUZZY:
+		if (!greedy)
+			return min_match(string, length, 0, start, end) !=
+			    INT_MAX;
+		if (!fuzzy_match(string, length, 0, &s, &e))
+			return 0;
+		*start = s - string;
+		*end = e - string;
+		return 1;
+	case MATCH_REGEX:
+		if (matcher.error || !regex_match(string, length, &rm))
+			return 0;
+		*start = rm.rm_so;
+		*end = rm.rm_eo;
+		return 1;
+	default:
+		break;
+	}
+
+	n = length;
+	if (matcher.ascii && memchr(string, '\033', n) == NULL) {
+		/* No escape sequences to skip, compare bytewise. */
+		if (matcher.mode == MATCH_EXACT)
+			s = horspool(string, n);
+		else if (matcher.mode == MATCH_PREFIX)
+			s = string;
+		else if (n >= matcher.length)
+			s = string + n - matcher.length;
+		else
+			s = NULL;
+		if (s == NULL ||
+		    (e = strcaseprefix(s, stop, matcher.pattern)) == NULL)
+			return 0;
+	} else if (matcher.mode == MATCH_PREFIX) {
+		for (s = string; s < stop && (n = skipescseq(s)) > 0; s += n)
+			continue;
+		if ((e = strcaseprefix(s, stop, matcher.pattern)) == NULL)
+			return 0;
+	} else {
+		for (s = string;; s++) {
+			if ((s = strcasechr(s, stop, matcher.pattern)) == NULL)
+				return 0;
+			if ((e = strcaseprefix(s, stop,
+			    matcher.pattern)) == NULL)
+				continue;
+			if (matcher.mode == MATCH_EXACT)
+				break;
+			/* Only escape sequences may follow a suffix. */
+			for (t = e; t < stop && (n = skipescseq(t)) > 0;
+			    t += n)
+				continue;
+			if (t >= stop)
+				break;
+		}
+	}
+
+	*start = s - string;
+	*end = e - string;
+	return 1;
+}
+
+/*
+ * Returns non-zero if the compiled regular expression matches the string of the
+ * given length, the match is then stored in rm. See query_match() regarding the
+ * string.
+ */
+int
+regex_match(const char *string, size_t length, regmatch_t *rm)
+{
+#ifdef REG_STARTEND
+	rm->rm_so = 0;
+	rm->rm_eo = length;
+	return regexec(&matcher.regex, string, 1, rm, REG_STARTEND) == 0;
+#else
+	char *s;
+	int matched;
+
+	if (string[length] == '\0')
+		return regexec(&matcher.regex, string, 1, rm, 0) == 0;
+
+	/* Only a field is not NUL-terminated, match a copy of it instead. */
+	if ((s = strndup(string, length)) == NULL)
+		err(1, NULL);
+	matched = regexec(&matcher.regex, s, 1, rm, 0) == 0;
+	free(s);
+	return matched;
+#endif
+}
+
+/*
+ * Returns a pointer to the first occurrence of the compiled literal in the
+ * first n bytes of s, using the Boyer-Moore-Horspool algorithm. The bytes of s
+ * are folded using the table of the matcher.
+ */
+__multiversion const char *
+horspool(const char *s, size_t n)
+{
+	const unsigned char *f = matcher.fold;
+	const unsigned char *p = (const unsigned char *)matcher.pattern;
+	const unsigned char *t = (const unsigned char *)s;
+	size_t i, j, m;
+
+	m = matcher.length;
+	for (i = 0; i + m <= n; i += matcher.skip[f[t[i + m - 1]]]) {
+		for (j = m; j > 0 && f[t[i + j - 1]] == p[j - 1]; j--)
+			continue;
+		if (j == 0)
+			return s + i;
+	}
+
+	return NULL;
+}
+
+/*
+ * Find the left-most match of the fuzzy query starting at offset in the string
+ * of the given length, matching each character as early as possible. Returns
+ * zero if there is no match, otherwise the start and end of the match is stored
+ * in s and e.
+ */
+__multiversion int
+fuzzy_match(const char *string, size_t length, size_t offset, const char **s,
+    const char **e)
+{
+	wchar_t wc;
+	const char *q;
+	const char *stop = string + length;
+	size_t i;
 
 	q = query;
-	if (*q == '\0' || (s = e = strcasechr(&string[offset], q)) == NULL)
-		return INT_MAX;
+	if (*q == '\0')
+		return 0;
+
+	if (matcher.bytewise) {
+		/* Every character is a single byte, see query_compile(). */
+		if ((*s = *e = strbytechr(&string[offset], stop,
+		    matcher.sets[0])) == NULL)
+			return 0;
+		for (i = 1; i < matcher.length; i++)
+			if ((*e = strbytechr(*e + 1, stop,
+			    matcher.sets[i])) == NULL)
+				return 0;
+		(*e)++;
+		return 1;
+	}
 
+	if ((*s = *e = strcasechr(&string[offset], stop, q)) == NULL)
+		return 0;
 	for (;;) {
-		for (e++, q++; isu8cont(*q); e++, q++)
-			continue;
+		/*
+		 * Step past the matched characters, their lengths could differ
+		 * as the comparison disregards case.
+		 */
+		*e += xmbtowc(&wc, *e);
+		q += xmbtowc(&wc, q);
 		if (*q == '\0')
-			break;
-		if ((e = strcasechr(e, q)) == NULL)
-			return INT_MAX;
+			return 1;
+		if ((*e = strcasechr(*e, stop, q)) == NULL)
+			return 0;
 	}
+}
 
-	length = e - s;
-	/* LEQ is used to obtain the shortest left-most match. */
-	if (length == query_length ||
-	    length <= min_match(string, s - string + 1, start, end)) {
-		*start = s - string;
-		*end = e - string;
+/*
+ * Find the shortest left-most match of the fuzzy query starting at offset in
+ * the string of the given length, by trying each position the greedy match
+ * could start at. Once more than maxscan bytes are scanned, the shortest match
+ * found so far is used which bounds the cost of extremely long lines. Returns
+ * INT_MAX if there is no match, otherwise the length of the match stored in
+ * start and end.
+ */
+__multiversion size_t
+min_match(const char *string, size_t length, size_t offset, ssize_t *start,
+    ssize_t *end)
+{
+	const char *e, *s;
+	size_t n;
+	size_t min = INT_MAX;
+	size_t scanned = 0;
+
+	for (; fuzzy_match(string, length, offset, &s, &e);
+	    offset = s - string + 1) {
+		n = e - s;
+		/* Strictly less is used to obtain the left-most match. */
+		if (n < min) {
+			min = n;
+			*start = s - string;
+			*end = e - string;
+		}
+
+		scanned += e - string - offset;
+		if (n == matcher.nchars || scanned > maxscan)
+			break;
 	}
 
-	return *end - *start;
+	return min;
 }
 
 /*
- * Returns a pointer to first occurrence of the first character in s2 in s1 with
- * respect to Unicode characters disregarding case.
+ * Returns a pointer to the first occurrence of any byte in set in s before
+ * stop, outside of escape sequences. The set consists of the byte searched for,
+ * optionally followed by the same letter in the opposite case, followed by the
+ * escape character unless searched for. The search could continue past stop up
+ * to the NUL-terminator, which is cheaper than bounding it.
  */
 const char *
-strcasechr(const char *s1, const char *s2)
+strbytechr(const char *s, const char *stop, const char *set)
+{
+	size_t n;
+
+	for (;; s++) {
+		if ((s = strpbrk(s, set)) == NULL || s >= stop)
+			return NULL;
+		if (*s != '\033')
+			return s;
+		/* A match inside an escape sequence is ignored. */
+		if ((n = skipescseq(s)) > 0)
+			s += n - 1;
+		else if (set[0] == '\033')
+			return s;
+	}
+}
+
+/*
+ * Returns a pointer to first occurrence of the first character in s2 in s1
+ * before stop with respect to Unicode characters, disregarding case unless the
+ * matcher says otherwise.
+ */
+const char *
+strcasechr(const char *s1, const char *stop, const char *s2)
 {
 	wchar_t wc1, wc2;
 	size_t i;
@@ -591,12 +3922,13 @@ strcasechr(const char *s1, const char *s2)
 	if (xmbtowc(&wc2, s2) == 0)
 		return NULL;
 
-	for (i = 0; s1[i] != '\0';) {
+	for (i = 0; s1 + i < stop && s1[i] != '\0';) {
 		if ((nbytes = skipescseq(s1 + i)) > 0)
 			/* A match inside an escape sequence is ignored. */;
 		else if ((nbytes = xmbtowc(&wc1, s1 + i)) == 0)
 			nbytes = 1;
-		else if (wcsncasecmp(&wc1, &wc2, 1) == 0)
+		else if (matcher.icase ? wcsncasecmp(&wc1, &wc2, 1) == 0 :
+		    wc1 == wc2)
 			return s1 + i;
 		i += nbytes;
 	}
@@ -604,6 +3936,39 @@ strcasechr(const char *s1, const char *s2)
 	return NULL;
 }
 
+/*
+ * Returns a pointer past the prefix p of s before stop with respect to Unicode
+ * characters, disregarding case unless the matcher says otherwise, or NULL if p
+ * is not a prefix of s.
+ */
+const char *
+strcaseprefix(const char *s, const char *stop, const char *p)
+{
+	wchar_t wc1, wc2;
+	int n1, n2;
+
+	while (*p != '\0') {
+		if (s >= stop)
+			return NULL;
+		if (!isu8start(*p)) {
+			if (matcher.fold[(unsigned char)*s] !=
+			    matcher.fold[(unsigned char)*p])
+				return NULL;
+			s++, p++;
+			continue;
+		}
+
+		if ((n1 = xmbtowc(&wc1, s)) == 0 ||
+		    (n2 = xmbtowc(&wc2, p)) == 0 ||
+		    (matcher.icase ? wcsncasecmp(&wc1, &wc2, 1) != 0 :
+		    wc1 != wc2))
+			return NULL;
+		s += n1, p += n2;
+	}
+
+	return s > stop ? NULL : s;
+}
+
 /*
  * Returns the length of a CSI or OSC escape sequence located at the beginning
  * of str.
@@ -625,15 +3990,17 @@ skipescseq(const char *str)
 	for (i = 2; str[i] != '\0'; i++)
 		if ((csi && str[i] >= '@' && str[i] <= '~') ||
 		    (osc && str[i] == '\a'))
-			break;
+			return i + 1;
 
-	return i + 1;
+	/* An unterminated sequence extends to the end of the string. */
+	return i;
 }
 
 void
 tty_init(int doinit)
 {
 	struct termios new_attributes;
+	int i;
 
 	if (doinit && (tty_in = fopen("/dev/tty", "r")) == NULL)
 		err(1, "fopen");
@@ -650,17 +4017,98 @@ tty_init(int doinit)
 	if (doinit && (tty_out = fopen("/dev/tty", "w")) == NULL)
 		err(1, "fopen");
 
-	if (doinit)
+	if (doinit) {
 		setupterm((char *)0, fileno(tty_out), (int *)0);
 
+		/*
+		 * Signals of interest are delivered through a pipe, allowing
+		 * them to be waited for along with input from the terminal.
+		 */
+		if (pipe(signal_pipe) == -1)
+			err(1, "pipe");
+		for (i = 0; i < 2; i++)
+			if (fcntl(signal_pipe[i], F_SETFL, O_NONBLOCK) == -1 ||
+			    fcntl(signal_pipe[i], F_SETFD, FD_CLOEXEC) == -1)
+				err(1, "fcntl");
+		signal_action(SIGCONT, handle_signal);
+		signal_action(SIGTSTP, handle_signal);
+		signal_action(SIGWINCH, handle_signal);
+	}
+
+	keys_init();
+
 	tty_size();
 
 	if (use_keypad)
 		tty_putp(keypad_xmit, 0);
 	if (use_alternate_screen)
 		tty_putp(enter_ca_mode, 0);
+}
 
-	toggle_sigwinch(0);
+/*
+ * Compile the keys into an automaton with one state per unique key prefix,
+ * recognizing the key sequences in a single pass over the input. The keys are
+ * matched in order, a key is therefore ignored if an earlier key is a prefix of
+ * it or vice versa.
+ */
+void
+keys_init(void)
+{
+	struct keystate *st;
+	const char *str;
+	char tiostr[2];
+	size_t i, j;
+	int next, state;
+
+	keystates.length = 0;
+	keystate_new();
+
+	for (i = 0; keys[i].key != UNKNOWN; i++) {
+		if (keys[i].tio >= 0) {
+			if (tio.c_cc[keys[i].tio] == _POSIX_VDISABLE)
+				continue;
+			tiostr[0] = tio.c_cc[keys[i].tio];
+			tiostr[1] = '\0';
+			str = tiostr;
+		} else if (keys[i].cap != NULL) {
+			str = tty_getcap(keys[i].cap);
+		} else {
+			str = keys[i].str;
+		}
+
+		for (state = 0, j = 0; str[j] != '\0'; j++) {
+			if (keystates.v[state].key != UNKNOWN)
+				break;
+			st = &keystates.v[state];
+			if ((next = st->next[(unsigned char)str[j]]) == 0) {
+				next = keystate_new();
+				st = &keystates.v[state];
+				st->next[(unsigned char)str[j]] = next;
+				st->nnext++;
+			}
+			state = next;
+		}
+		st = &keystates.v[state];
+		if (j > 0 && str[j] == '\0' && st->key == UNKNOWN &&
+		    st->nnext == 0)
+			st->key = keys[i].key;
+	}
+}
+
+int
+keystate_new(void)
+{
+	if (keystates.length == keystates.size) {
+		keystates.size = keystates.size == 0 ? 64 : 2 * keystates.size;
+		if ((keystates.v = reallocarray(keystates.v, keystates.size,
+		    sizeof(*keystates.v))) == NULL)
+			err(1, NULL);
+	}
+	if (keystates.length > SHRT_MAX)
+		errx(1, "too many keys");
+	memset(&keystates.v[keystates.length], 0, sizeof(*keystates.v));
+
+	return keystates.length++;
 }
 
 int
@@ -672,23 +4120,33 @@ tty_putc(int c)
 	return c;
 }
 
+/*
+ * Forward the signal to the main loop by writing its number to the signal
+ * pipe, see tty_wait().
+ */
 void
-handle_sigwinch(int sig)
+handle_signal(int sig)
 {
-	gotsigwinch = sig == SIGWINCH;
+	unsigned char c = sig;
+	int save_errno = errno;
+	ssize_t n;
+
+	n = write(signal_pipe[1], &c, 1);
+	(void)n;
+	errno = save_errno;
 }
 
 void
-toggle_sigwinch(int enable)
+signal_action(int sig, void (*handler)(int))
 {
 	struct sigaction sa;
 
-	sa.sa_flags = 0;
-	sa.sa_handler = enable ? handle_sigwinch : SIG_IGN;
+	sa.sa_flags = SA_RESTART;
+	sa.sa_handler = handler;
 	sigemptyset(&sa.sa_mask);
 
-	if (sigaction(SIGWINCH, &sa, NULL) == -1)
-		err(1, "sigaction: SIGWINCH");
+	if (sigaction(sig, &sa, NULL) == -1)
+		err(1, "sigaction");
 }
 
 void
@@ -742,32 +4200,47 @@ tty_size(void)
 		tty_lines = 24;
 
 	choices_lines = tty_lines - 1;	/* available lines, minus query line */
+	if (preview.command != NULL) {
+		/* The preview occupies the lower half of the lines. */
+		preview_lines = choices_lines / 2;
+		choices_lines -= preview_lines;
+	}
 }
 
 void
-print_line(const char *str, size_t len, int standout, ssize_t enter_underline,
-    ssize_t exit_underline)
+print_line(const char *str, size_t len, unsigned int ncols, int standout,
+    const struct span *spans, size_t nspans)
 {
-	size_t i;
+	size_t i, stop;
 	wchar_t wc;
 	unsigned int col;
-	int nbytes, width;
+	int nbytes, underline, width;
 
 	if (standout)
 		tty_putp(enter_standout_mode, 1);
 
+	/* Only the next span boundary is of interest. */
+	stop = nspans > 0 ? spans->start : SIZE_MAX;
 	col = i = 0;
-	while (col < tty_columns) {
-		if (enter_underline == (ssize_t)i)
-			tty_putp(enter_underline_mode, 1);
-		else if (exit_underline == (ssize_t)i)
-			tty_putp(exit_underline_mode, 1);
+	underline = 0;
+	while (col < ncols) {
+		if (i >= stop) {
+			if (underline) {
+				tty_putp(exit_underline_mode, 1);
+				spans++, nspans--;
+				stop = nspans > 0 ? spans->start : SIZE_MAX;
+			} else {
+				tty_putp(enter_underline_mode, 1);
+				stop = spans->end;
+			}
+			underline = !underline;
+		}
 		if (i == len)
 			break;
 
 		if (str[i] == '\t') {
 			width = 8 - (col & 7);	/* ceil to multiple of 8 */
-			if (col + width > tty_columns)
+			if (col + width > ncols)
 				break;
 			col += width;
 
@@ -802,47 +4275,96 @@ print_line(const char *str, size_t len, int standout, ssize_t enter_underline,
 			width = 0;
 		}
 
-		if (col + width > tty_columns)
+		if (col + width > ncols)
 			break;
 		col += width;
 
 		for (; nbytes > 0; nbytes--, i++)
 			tty_putc(str[i]);
 	}
-	for (; col < tty_columns; col++)
+	for (; col < ncols; col++)
 		tty_putc(' ');
 
 	/*
-	 * If exit_underline is greater than columns the underline attribute
-	 * will spill over on the next line unless all attributes are exited.
+	 * If a span extends beyond the columns the underline attribute will
+	 * spill over on the next line unless all attributes are exited.
 	 */
 	tty_putp(exit_attribute_mode, 1);
 }
 
 /*
- * Output as many choices as possible starting from offset and return the number
- * of choices with a positive score. If the query is empty, all choices are
- * considered having a positive score.
+ * Output the query, scrolled horizontally to keep the cursor position visible,
+ * followed by the number of matches and choices right-aligned on the same line.
+ * The matches are counted while filtering, if not all choices were visited the
+ * count is suffixed with a plus sign.
+ */
+void
+print_query(size_t cursor_position)
+{
+	char count[64];
+	size_t xscroll = 0;
+	unsigned int ncols;
+	int i, n;
+
+	n = snprintf(count, sizeof(count), " %zu%s/%zu", matches.count,
+	    matches.partial ? "+" : "", choices.length);
+	/* Leave at least one column to the query. */
+	if (n < 0 || (unsigned int)n >= tty_columns)
+		n = 0;
+	ncols = tty_columns - n;
+
+	if (cursor_position >= ncols)
+		xscroll = cursor_position - ncols + 1;
+	print_line(&query[xscroll], query_length - xscroll, ncols, 0, NULL, 0);
+	for (i = 0; i < n; i++)
+		tty_putc(count[i]);
+}
+
+/*
+ * Output as many matches as possible starting from offset and return the number
+ * of matches. If the query is empty, all choices are considered matches. If
+ * jump is non-zero, each match is preceded by its label of the given length.
  */
 size_t
-print_choices(size_t offset, size_t selection)
+print_choices(size_t offset, size_t selection, size_t jump)
 {
 	const struct choice *choice;
-	size_t i;
-
-	for (i = offset; i < choices.length; i++) {
-		choice = choices.v + i;
-		if (choice->score == 0 && query_length > 0)
-			break;
-
-		if (i - offset < choices_lines) {
-			print_line(choice->string, choice->length,
-			    i == selection, choice->match_start,
-			    choice->match_end);
+	struct span *spans;
+	size_t i, j, n, nspans;
+	unsigned int ncols;
+
+	for (i = offset; i < matches.length && i - offset < choices_lines;
+	    i++) {
+		choice = matches.v[i];
+		spans = match_spans(choice, &nspans);
+		ncols = tty_columns;
+		if (jump > 0 && jump + 1 < ncols) {
+			/* The label precedes the choice. */
+			for (j = 1, n = 1; j < jump; j++)
+				n *= JUMP_NLABELS;
+			tty_putp(enter_bold_mode, 0);
+			for (; n > 0; n /= JUMP_NLABELS)
+				tty_putc(JUMP_LABELS[(i - offset) / n %
+				    JUMP_NLABELS]);
+			tty_putp(exit_attribute_mode, 1);
+			tty_putc(' ');
+			ncols -= jump + 1;
 		}
+		print_line(choice->string, choice->length, ncols,
+		    i == selection, spans, nspans);
 	}
 
-	if (i - offset < choices.length && i - offset < choices_lines) {
+	if (preview.command != NULL) {
+		/*
+		 * Clear the remaining lines available to the choices, followed
+		 * by the preview which always occupies the same lines.
+		 */
+		for (n = i - offset; n < choices_lines; n++)
+			print_line("", 0, tty_columns, 0, NULL, 0);
+		preview_print();
+		tty_putp(tty_parm1(parm_up_cursor,
+		    choices_lines + preview_lines), 1);
+	} else if (i - offset < choices.length && i - offset < choices_lines) {
 		/*
 		 * Printing the choices did not consume all available
 		 * lines and there could still be choices left from the
@@ -857,117 +4379,43 @@ print_choices(size_t offset, size_t selection)
 		tty_putc('\n');
 		tty_putp(clr_eos, 1);
 		tty_putp(tty_parm1(parm_up_cursor, (i - offset) + 1), 1);
-	} else if (i > 0) {
+	} else if (i - offset > 0) {
 		/*
 		 * parm_up_cursor interprets 0 as 1, therefore only move
 		 * upwards if any choices where printed.
 		 */
-		tty_putp(tty_parm1(parm_up_cursor,
-		    i < choices_lines ? i : choices_lines), 1);
+		tty_putp(tty_parm1(parm_up_cursor, i - offset), 1);
 	}
 
-	return i;
+	return matches.length;
 }
 
 enum key
 get_key(const char **key)
 {
-#define	CAP(k, s)	{ k,	s,	NULL,	0,		-1 }
-#define	KEY(k, s)	{ k,	NULL,	s,	sizeof(s) - 1,	-1 }
-#define	TIO(k, i)	{ k,	NULL,	NULL,	0,		i }
-	static struct {
-		enum key	 key;
-		char		*cap;
-		const char	*str;
-		size_t		 len;
-		int		 tio;
-	} keys[] = {
-		KEY(ALT_ENTER,	"\033\n"),
-		KEY(BACKSPACE,	"\177"),
-		KEY(BACKSPACE,	"\b"),
-		KEY(CTRL_A,	"\001"),
-		TIO(CTRL_C,	VINTR),
-		KEY(CTRL_E,	"\005"),
-		KEY(CTRL_K,	"\013"),
-		KEY(CTRL_L,	"\014"),
-		KEY(CTRL_O,	"\017"),
-		KEY(CTRL_U,	"\025"),
-		KEY(CTRL_W,	"\027"),
-		KEY(CTRL_W,	"\033\177"),
-		KEY(CTRL_W,	"\033\b"),
-		TIO(CTRL_Z,	VSUSP),
-		CAP(DEL,	"kdch1"),
-		KEY(DEL,	"\004"),
-		CAP(END,	"kend"),
-		KEY(END,	"\033>"),
-		KEY(ENTER,	"\n"),
-		CAP(ENTER,	"kent"),
-		CAP(HOME,	"khome"),
-		KEY(HOME,	"\033<"),
-		CAP(LEFT,	"kcub1"),
-		KEY(LEFT,	"\002"),
-		KEY(LEFT,	"\033OD"),
-		CAP(LINE_DOWN,	"kcud1"),
-		KEY(LINE_DOWN,	"\016"),
-		KEY(LINE_DOWN,	"\033OB"),
-		CAP(LINE_UP,	"kcuu1"),
-		KEY(LINE_UP,	"\020"),
-		KEY(LINE_UP,	"\033OA"),
-		CAP(PAGE_DOWN,	"knp"),
-		KEY(PAGE_DOWN,	"\026"),
-		KEY(PAGE_DOWN,	"\033 "),
-		CAP(PAGE_UP,	"kpp"),
-		KEY(PAGE_UP,	"\033v"),
-		CAP(RIGHT,	"kcuf1"),
-		KEY(RIGHT,	"\006"),
-		KEY(RIGHT,	"\033OC"),
-		KEY(UNKNOWN,	NULL),
-	};
 	static unsigned char buf[8];
+	enum key k;
 	size_t len;
-	int c, i;
+	int c, state;
 
 	memset(buf, 0, sizeof(buf));
 	*key = (const char *)buf;
 	len = 0;
 
 	/*
-	 * Allow SIGWINCH on the first read. If the signal is received, return
-	 * CTRL_L which will trigger a resize.
+	 * Unless there's already buffered input, wait for either input or a
+	 * signal. A received signal is handled as the corresponding key.
 	 */
-	toggle_sigwinch(1);
+	if (tty_ibuf.pos == tty_ibuf.length && (k = tty_wait()) != UNKNOWN)
+		return k;
 	buf[len++] = tty_getc();
-	toggle_sigwinch(0);
-	if (gotsigwinch) {
-		gotsigwinch = 0;
-		return CTRL_L;
-	}
-
-	for (;;) {
-		for (i = 0; keys[i].key != UNKNOWN; i++) {
-			if (keys[i].tio >= 0) {
-				if (len == 1 &&
-				    tio.c_cc[keys[i].tio] == *buf &&
-				    tio.c_cc[keys[i].tio] != _POSIX_VDISABLE)
-					return keys[i].key;
-				continue;
-			}
 
-			if (keys[i].str == NULL) {
-				keys[i].str = tty_getcap(keys[i].cap);
-				keys[i].len = strlen(keys[i].str);
-			}
-			if (strncmp(keys[i].str, *key, len) != 0)
-				continue;
-
-			if (len == keys[i].len)
-				return keys[i].key;
-
-			/* Partial match found, continue reading. */
-			break;
-		}
-		if (keys[i].key == UNKNOWN)
+	/* Walk the automaton as long as the input is a prefix of any key. */
+	for (state = 0;;) {
+		if ((state = keystates.v[state].next[buf[len - 1]]) == 0)
 			break;
+		if (keystates.v[state].key != UNKNOWN)
+			return keystates.v[state].key;
 
 		if (len == sizeof(buf) - 1)
 			break;
@@ -1011,15 +4459,115 @@ get_key(const char **key)
 	return PRINTABLE;
 }
 
+/*
+ * Returns the next character of input, read in bulk from the terminal.
+ */
 int
 tty_getc(void)
 {
-	int c;
+	ssize_t n;
+
+	if (tty_ibuf.pos == tty_ibuf.length) {
+		while ((n = read(fileno(tty_in), tty_ibuf.v,
+		    sizeof(tty_ibuf.v))) == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			err(1, "read");
+		if (n == 0)
+			errx(1, "read: end of file");
+		tty_ibuf.pos = 0;
+		tty_ibuf.length = n;
+	}
 
-	if ((c = getc(tty_in)) == ERR && !gotsigwinch)
-		err(1, "getc");
+	return tty_ibuf.v[tty_ibuf.pos++];
+}
 
-	return c;
+/*
+ * Returns non-zero if there's pending input, either already buffered or
+ * available for reading, or a received signal.
+ */
+int
+tty_pending(void)
+{
+	struct pollfd pfds[2];
+	int nready;
+
+	if (tty_ibuf.pos < tty_ibuf.length)
+		return 1;
+
+	pfds[0].fd = fileno(tty_in);
+	pfds[0].events = POLLIN;
+	pfds[1].fd = signal_pipe[0];
+	pfds[1].events = POLLIN;
+	if ((nready = poll(pfds, 2, 0)) == -1 && errno != EINTR)
+		err(1, "poll");
+	return nready > 0;
+}
+
+/*
+ * Waits until either the terminal or the signal pipe is readable, meanwhile
+ * reading the output of the preview and reload commands. Returns the key
+ * corresponding to the received signals, if any, or REDRAW if the preview must
+ * be redrawn.
+ * Otherwise, UNKNOWN is returned and input is available for reading from the
+ * terminal.
+ */
+enum key
+tty_wait(void)
+{
+	struct pollfd pfds[4];
+	enum key key = UNKNOWN;
+	unsigned char sig;
+	int nready;
+	int redraw = 0;
+
+	pfds[0].fd = fileno(tty_in);
+	pfds[0].events = POLLIN;
+	pfds[1].fd = signal_pipe[0];
+	pfds[1].events = POLLIN;
+	for (;;) {
+		/* A negative descriptor is ignored by poll(2). */
+		pfds[2].fd = preview.fd;
+		pfds[2].events = POLLIN;
+		pfds[3].fd = reload.fd;
+		pfds[3].events = POLLIN;
+		if ((nready = poll(pfds, 4, reload_timeout())) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+		if (nready == 0) {
+			/* Otherwise, the deferred keys are due. */
+			if (!reload.pending)
+				return REDRAW;
+			reload_start();
+			continue;
+		}
+		if (pfds[1].revents & POLLIN)
+			break;
+		if (pfds[2].fd != -1 && pfds[2].revents && preview_read())
+			redraw = 1;
+		if (pfds[3].fd != -1 && pfds[3].revents && reload_read())
+			redraw = 1;
+		if (pfds[0].revents)
+			return UNKNOWN;
+		if (redraw)
+			return REDRAW;
+	}
+
+	while (read(signal_pipe[0], &sig, 1) == 1)
+		switch (sig) {
+		case SIGTSTP:
+			key = CTRL_Z;
+			break;
+		case SIGCONT:
+		case SIGWINCH:
+			if (key == UNKNOWN)
+				key = CTRL_L;
+			break;
+		}
+
+	return key;
 }
 
 const char *
@@ -1072,14 +4620,17 @@ isword(const char *s)
 int
 xmbtowc(wchar_t *wc, const char *s)
 {
-	int n;
+	mbstate_t ps;
+	size_t n;
 
-	n = mbtowc(wc, s, MB_CUR_MAX);
-	if (n == -1) {
-		/* Assign in order to suppress ignored return value warning. */
-		n = mbtowc(NULL, NULL, MB_CUR_MAX);
+	/*
+	 * The conversion state is kept local as choices are matched in
+	 * parallel.
+	 */
+	memset(&ps, 0, sizeof(ps));
+	n = mbrtowc(wc, s, MB_CUR_MAX, &ps);
+	if (n == (size_t)-1 || n == (size_t)-2)
 		return 0;
-	}
 
 	return n;
 }
@@ -13,11 +13,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 static __dead void	 child(int, int, int, char **);
-static void		 parent(int, int, const char *);
-static char		*parsekeys(const char *);
+static long long	 elapsed(const struct timespec *);
+static void		 parent(int, int, const char *, const size_t *, size_t,
+    long long);
+static char		*parsekeys(const char *, size_t **, size_t *);
+static void		 pushend(size_t **, size_t *, size_t);
 static void		 sighandler(int);
 static __dead void	 usage(void);
 
@@ -35,14 +39,23 @@ static int gotsig;
 int
 main(int argc, char *argv[])
 {
+	const char *errstr;
 	char *keys = NULL;
+	size_t *ends = NULL;
+	size_t nends = 0;
+	long long budget = 0;
 	pid_t pid;
 	int c, master, slave, status;
 
-	while ((c = getopt(argc, argv, "k:")) != -1)
+	while ((c = getopt(argc, argv, "b:k:")) != -1)
 		switch (c) {
+		case 'b':
+			budget = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "budget %s: %s", errstr, optarg);
+			break;
 		case 'k':
-			keys = parsekeys(optarg);
+			keys = parsekeys(optarg, &ends, &nends);
 			break;
 		default:
 			usage();
@@ -71,7 +84,8 @@ main(int argc, char *argv[])
 		child(master, slave, argc, argv);
 		/* NOTREACHED */
 	default:
-		parent(master, slave, keys != NULL ? keys : "");
+		parent(master, slave, keys != NULL ? keys : "", ends, nends,
+		    budget);
 		/* Wait and exit with code of the child process. */
 		waitpid(pid, &status, 0);
 		if (WIFSIGNALED(status))
@@ -81,6 +95,7 @@ main(int argc, char *argv[])
 	}
 
 	free(keys);
+	free(ends);
 
 	return 0;
 }
@@ -88,13 +103,17 @@ main(int argc, char *argv[])
 static __dead void
 usage(void)
 {
-	fprintf(stderr, "usage: pick-test [-k path] -- utility "
+	fprintf(stderr, "usage: pick-test [-b budget] [-k path] -- utility "
 	    "[argument ...]\n");
 	exit(1);
 }
 
+/*
+ * Parse the keys read from path. Unescaped spaces separate the keys, the offset
+ * where each key ends is stored in ends.
+ */
 static char *
-parsekeys(const char *path)
+parsekeys(const char *path, size_t **ends, size_t *nends)
 {
 	FILE *fh;
 	char *buf;
@@ -113,6 +132,7 @@ parsekeys(const char *path)
 		if (c == '\\') {
 			esc = 1;
 		} else if (!esc && c == ' ') {
+			pushend(ends, nends, len);
 			continue;
 		} else if (c == '^') {
 			ctrl = 'A' - 1;
@@ -132,10 +152,26 @@ parsekeys(const char *path)
 		err(1, "fgetc: %s", path);
 	fclose(fh);
 	buf[len] = '\0';
+	pushend(ends, nends, len);
 
 	return buf;
 }
 
+/*
+ * Mark the end of a key at offset end, unless the key is empty.
+ */
+static void
+pushend(size_t **ends, size_t *nends, size_t end)
+{
+	if (end == 0 || (*nends > 0 && (*ends)[*nends - 1] == end))
+		return;
+
+	*ends = reallocarray(*ends, *nends + 1, sizeof(**ends));
+	if (*ends == NULL)
+		err(1, NULL);
+	(*ends)[(*nends)++] = end;
+}
+
 static void
 sighandler(int sig)
 {
@@ -203,20 +239,46 @@ child(int master, int slave, int argc, char **argv)
 	err(1, "sh");
 }
 
+/*
+ * Write the keys to the child process once it has flushed its output. If a
+ * budget is given, the keys are instead written one at a time and the time
+ * elapsed until the child flushes its next frame must not exceed the budget in
+ * milliseconds.
+ */
 static void
-parent(int master, int slave, const char *keys)
+parent(int master, int slave, const char *keys, const size_t *ends,
+    size_t nends, long long budget)
 {
 	char buf[BUFSIZ];
 	fd_set rfd;
-	struct timeval timeout;
+	struct timespec sent;
+	struct timeval limit, timeout;
 	size_t written = 0;
+	size_t key = 0;
 	size_t len;
+	ssize_t n;
+	long long ms;
+	int pending = 0;
 
 	len = strlen(keys);
 
-	memset(&timeout, 0, sizeof(timeout));
-	timeout.tv_sec = 2;
+	memset(&limit, 0, sizeof(limit));
+	limit.tv_sec = 2;
 	while (gotsig == 0) {
+		if (pending) {
+			ms = budget - elapsed(&sent);
+			if (ms < 0)
+				ms = 0;
+			timeout.tv_sec = ms / 1000;
+			timeout.tv_usec = (ms % 1000) * 1000;
+		} else if (budget > 0) {
+			/* Allow generous time for reading large inputs. */
+			timeout.tv_sec = 60;
+			timeout.tv_usec = 0;
+		} else {
+			timeout = limit;
+		}
+
 		FD_ZERO(&rfd);
 		FD_SET(master, &rfd);
 		switch (select(master + 1, &rfd, NULL, NULL, &timeout)) {
@@ -226,9 +288,14 @@ parent(int master, int slave, const char *keys)
 			err(1, "select");
 			/* NOTREACHED */
 		case 0:
+			if (pending)
+				errx(1, "key %zu: no output within budget of "
+				    "%lld ms", key, budget);
 			errx(1, "time limit exceeded");
 			/* NOTREACHED */
 		default:
+			if (budget == 0)
+				limit = timeout;
 			if (!FD_ISSET(master, &rfd))
 				continue;
 		}
@@ -240,15 +307,32 @@ parent(int master, int slave, const char *keys)
 		if (read(master, buf, sizeof(buf)) == -1)
 			err(1, "read");
 
+		if (pending) {
+			pending = 0;
+			ms = elapsed(&sent);
+			if (ms > budget)
+				errx(1, "key %zu: %lld ms exceeds budget of "
+				    "%lld ms", key, ms, budget);
+		}
+
 		/*
 		 * When the pick process has flushed its output we can ensure
 		 * the call to tcsetattr has been completed and canonical mode
 		 * is disabled. At this point input can be written without any
 		 * line editing taking place.
 		 */
-		if (written < len) {
-			ssize_t n;
-
+		if (budget > 0 && key < nends) {
+			for (; written < ends[key]; written += n) {
+				n = write(master, keys + written,
+				    ends[key] - written);
+				if (n == -1)
+					err(1, "write");
+			}
+			if (clock_gettime(CLOCK_MONOTONIC, &sent) == -1)
+				err(1, "clock_gettime");
+			key++;
+			pending = 1;
+		} else if (budget == 0 && written < len) {
 			n = write(master, keys + written, len - written);
 			if (n == -1)
 				err(1, "write");
@@ -264,3 +348,17 @@ parent(int master, int slave, const char *keys)
 	 */
 	close(slave);
 }
+
+/*
+ * Returns the number of milliseconds elapsed since ts.
+ */
+static long long
+elapsed(const struct timespec *ts)
+{
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+		err(1, "clock_gettime");
+	return (now.tv_sec - ts->tv_sec) * 1000LL +
+	    (now.tv_nsec - ts->tv_nsec) / 1000000;
+}
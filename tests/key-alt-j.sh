@@ -0,0 +1,34 @@
+if testcase "alt j selects the labeled choice"; then
+	printf 'a\nb\nc\n' >"$STDIN"
+	pick -k "\\033j d" <<-EOF
+	c
+	EOF
+fi
+
+if testcase "alt j labels the matches"; then
+	printf 'a\nb\nab\n' >"$STDIN"
+	pick -k "b \\033j s" <<-EOF
+	ab
+	EOF
+fi
+
+if testcase "alt j labels relative to the first visible choice"; then
+	seq 1 30 >"$STDIN"
+	pick -k "\\026 \\033j s" <<-EOF
+	25
+	EOF
+fi
+
+if testcase "alt j is left on any other key"; then
+	printf 'a\nb\nc\n' >"$STDIN"
+	pick -k "\\033j \\016 \\n" <<-EOF
+	b
+	EOF
+fi
+
+if testcase "alt j is left on a key not being a label"; then
+	printf 'a\nb\nc\n' >"$STDIN"
+	pick -k "\\033j 1 \\n" <<-EOF
+	a
+	EOF
+fi
@@ -0,0 +1,27 @@
+if testcase "gzip compressed input" && command -v gzip >/dev/null; then
+	{ echo a; echo b; echo c; } | gzip >"$STDIN"
+	pick -k "b \\n" <<-EOF
+	b
+	EOF
+fi
+
+if testcase "gzip compressed input concatenated" && command -v gzip >/dev/null; then
+	{ echo a | gzip; echo b | gzip; } >"$STDIN"
+	pick -k "\\033OB \\n" <<-EOF
+	b
+	EOF
+fi
+
+if testcase "gzip compressed input trailing garbage" && command -v gzip >/dev/null; then
+	{ echo a | gzip; echo b | gzip; echo garbage; } >"$STDIN"
+	pick -k "\\033OB \\033OB \\n" <<-EOF
+	b
+	EOF
+fi
+
+if testcase "gzip compressed input truncated" && command -v gzip >/dev/null; then
+	seq 1000 | gzip | head -c 32 >"$STDIN"
+	pick -e <<-EOF
+	pick: gzip: unexpected end of input
+	EOF
+fi
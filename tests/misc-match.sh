@@ -12,6 +12,19 @@ if testcase "it favors the shortest match"; then
 	EOF
 fi
 
+if testcase "it favors the shortest match below the visible choices"; then
+	{
+		echo ab
+		echo axb
+		echo axxb
+		echo axxxxxb
+		echo axxxxxxxxab
+	} >"$STDIN"
+	pick -l 3 -k "ab \\033OB \\033OB \\033OB \\n" <<-EOF
+	axxxxxxxxab
+	EOF
+fi
+
 if testcase "do not match inside a csi escape sequence"; then
 	{ printf "\\033[32m33\\033[m\\n"; echo 3aaa2; } >"$STDIN"
 	pick -k "32 \\n" <<-EOF
@@ -28,3 +41,80 @@ if testcase "do not match inside a osc escape sequence"; then
 	favored match since the query is not inside the escape sequence example.com
 	EOF
 fi
+
+if testcase "exact match"; then
+	{ echo a-b; echo ab; echo xaby; } >"$STDIN"
+	pick -k "\\047ab \\n" -- -S <<-EOF
+	ab
+	EOF
+fi
+
+if testcase "exact match is case insensitive"; then
+	{ echo a-b; echo xABy; } >"$STDIN"
+	pick -k "\\047ab \\n" <<-EOF
+	xABy
+	EOF
+fi
+
+if testcase "exact match including unicode"; then
+	{ echo å-ä; echo xÅÄy; } >"$STDIN"
+	pick -k "\\047åä \\n" <<-EOF
+	xÅÄy
+	EOF
+fi
+
+if testcase "exact match favors shorter choices"; then
+	{ echo xxaby; echo xaby; } >"$STDIN"
+	pick -k "\\047ab \\n" <<-EOF
+	xaby
+	EOF
+fi
+
+if testcase "prefix match"; then
+	{ echo bab; echo abc; } >"$STDIN"
+	pick -k "\\n" -- -q "^ab" <<-EOF
+	abc
+	EOF
+fi
+
+if testcase "prefix match skips escape sequences"; then
+	{ echo bab; printf "\\033[32mabc\\033[m\\n"; } >"$STDIN"
+	pick -k "\\n" -- -q "^ab" <<-EOF
+	$(printf "\\033[32mabc\\033[m")
+	EOF
+fi
+
+if testcase "suffix match"; then
+	{ echo abc; echo cab; } >"$STDIN"
+	pick -k "ab$ \\n" <<-EOF
+	cab
+	EOF
+fi
+
+if testcase "suffix match refined"; then
+	{ echo cab; echo cxab; echo ab; } >"$STDIN"
+	pick -k "ab$ \\001 x \\n" <<-EOF
+	cxab
+	EOF
+fi
+
+if testcase "regex match"; then
+	{ echo abc; echo a1c; } >"$STDIN"
+	pick -k "/a[0-9]c/ \\n" <<-EOF
+	a1c
+	EOF
+fi
+
+if testcase "invalid regex matches nothing"; then
+	echo "(" >"$STDIN"
+	pick -k "/(/ \\n \\033\\n" <<-EOF
+	/(/
+	EOF
+fi
+
+if testcase "operator without pattern is matched fuzzy"; then
+	{ echo a; echo ^; } >"$STDIN"
+	pick -k "\\n" -- -q "^" <<-EOF
+	^
+	EOF
+fi
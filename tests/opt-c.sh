@@ -0,0 +1,48 @@
+if testcase "smart-case disregards case of lowercase query"; then
+	{ echo ABC; echo abc; } >"$STDIN"
+	pick -k "a b c \\n" -- -S -c <<-EOF
+	ABC
+	EOF
+fi
+
+if testcase "smart-case respects case of uppercase query"; then
+	{ echo abc; echo aBc; } >"$STDIN"
+	pick -k "a B c \\n" -- -S -c <<-EOF
+	aBc
+	EOF
+fi
+
+if testcase "smart-case respects case of exact query"; then
+	{ echo xabcx; echo xAbcx; } >"$STDIN"
+	pick -k "' A b \\n" -- -S -c <<-EOF
+	xAbcx
+	EOF
+fi
+
+if testcase "smart-case respects case of non-ascii query"; then
+	{ echo ä; echo Ä; } >"$STDIN"
+	pick -k "Ä \\n" -- -S -c <<-EOF
+	Ä
+	EOF
+fi
+
+if testcase "case-sensitive"; then
+	{ echo ABC; echo abc; } >"$STDIN"
+	pick -k "a b c \\n" -- -S -C <<-EOF
+	abc
+	EOF
+fi
+
+if testcase "case-sensitive regex"; then
+	{ echo ABC; echo abc; } >"$STDIN"
+	pick -k "/ b / \\n" -- -S -C <<-EOF
+	abc
+	EOF
+fi
+
+if testcase "case-sensitive with escape sequences"; then
+	{ printf 'A\033[1mB\033[0m\n'; printf 'a\033[1mb\033[0m\n'; } >"$STDIN"
+	pick -k "a b \\n" -- -S -C <<-EOF
+	$(printf 'a\033[1mb\033[0m')
+	EOF
+fi
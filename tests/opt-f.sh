@@ -0,0 +1,55 @@
+if testcase "snapshot"; then
+	{ echo a; echo bb; echo c; } | "$PICK" -w "${TSHDIR}/snap"
+	pick -k "b \\n" -- -f "${TSHDIR}/snap" <<-EOF
+	bb
+	EOF
+fi
+
+if testcase "snapshot replaces stdin"; then
+	echo a | "$PICK" -w "${TSHDIR}/snap"
+	echo b >"$STDIN"
+	pick -k "\\n" -- -f "${TSHDIR}/snap" <<-EOF
+	a
+	EOF
+fi
+
+if testcase "snapshot with descriptions"; then
+	{ echo a 1; echo b; echo c 3; } | "$PICK" -d -w "${TSHDIR}/snap"
+	pick -k "c \\n" -- -d -o -f "${TSHDIR}/snap" <<-EOF
+	c
+	3
+	EOF
+fi
+
+if testcase "snapshot with fields"; then
+	{ echo a b; echo b c; } | "$PICK" -n 2 -w "${TSHDIR}/snap"
+	pick -k "c \\n" -- -n 2 -f "${TSHDIR}/snap" <<-EOF
+	b c
+	EOF
+fi
+
+if testcase "snapshot with alt enter"; then
+	echo a | "$PICK" -w "${TSHDIR}/snap"
+	pick -k "b \\033\\n" -- -f "${TSHDIR}/snap" <<-EOF
+	b
+	EOF
+fi
+
+if testcase "snapshot of empty input"; then
+	"$PICK" -w "${TSHDIR}/snap" </dev/null
+	pick -e -k "^C" -- -f "${TSHDIR}/snap" </dev/null
+fi
+
+if testcase "snapshot written using different options"; then
+	echo a | "$PICK" -w "${TSHDIR}/snap"
+	pick -e -- -u -f "${TSHDIR}/snap" <<-EOF
+	pick: ${TSHDIR}/snap: snapshot written using different options
+	EOF
+fi
+
+if testcase "snapshot invalid file"; then
+	echo a >"${TSHDIR}/snap"
+	pick -e -- -f "${TSHDIR}/snap" <<-EOF
+	pick: ${TSHDIR}/snap: invalid snapshot file
+	EOF
+fi
@@ -0,0 +1,40 @@
+setup() {
+	HISTORY="${TSHDIR}/history"
+}
+
+if testcase "selected choices are favored"; then
+	{ echo ab; echo aab; } >"$STDIN"
+	pick -k "aab \\n" -- -H "$HISTORY" <<-EOF
+	aab
+	EOF
+	pick -k "b \\n" -- -H "$HISTORY" <<-EOF
+	aab
+	EOF
+fi
+
+if testcase "selected choices are favored using an empty query"; then
+	{ echo a; echo b; echo c; } >"$STDIN"
+	pick -k "c \\n" -- -H "$HISTORY" <<-EOF
+	c
+	EOF
+	pick -k "\\n" -- -H "$HISTORY" <<-EOF
+	c
+	EOF
+fi
+
+if testcase "history is grown"; then
+	seq 100 >"$STDIN"
+	for i in $(seq 60) 7; do
+		echo "$i" | pick -k "${i} \\n" -- -H "$HISTORY"
+	done
+	pick -k "\\n" -- -H "$HISTORY" <<-EOF
+	7
+	EOF
+fi
+
+if testcase "invalid history file"; then
+	echo garbage >"$HISTORY"
+	pick -e -- -H "$HISTORY" <<-EOF
+	pick: ${HISTORY}: invalid history file
+	EOF
+fi
@@ -0,0 +1,46 @@
+if testcase "threads single"; then
+	seq 1 100000 >"$STDIN"
+	pick -k "99999 \\n" -- -j 1 <<-EOF
+	99999
+	EOF
+fi
+
+if testcase "threads many"; then
+	seq 1 100000 >"$STDIN"
+	pick -k "99999 \\n" -- -j 4 <<-EOF
+	99999
+	EOF
+fi
+
+if testcase "threads many while narrowing the query"; then
+	seq 1 100000 >"$STDIN"
+	pick -k "9 9 9 9 \\177 9 9 \\n" -- -j 4 <<-EOF
+	99999
+	EOF
+fi
+
+if testcase "threads invalid argument"; then
+	pick -e -- -j 0 <<-EOF
+	pick: threads too small: 0
+	EOF
+fi
+
+if testcase "threads agree on the order of many matches"; then
+	# More matches than SORT_MIN, causing the runs to be merged.
+	seq 1 200000 >"$STDIN"
+	printf '1 \026 \026 \026 \016 \n' >"${TSHDIR}/keys"
+	"$PTY" -k "${TSHDIR}/keys" -- "$PICK" -j 1 <"$STDIN" >"${TSHDIR}/want"
+	for _j in 2 3 4 7; do
+		pick -k "1 \\026 \\026 \\026 \\016 \\n" -- -j "$_j" \
+			<"${TSHDIR}/want"
+	done
+fi
+
+if testcase "threads agree on the last of many matches"; then
+	seq 1 200000 >"$STDIN"
+	printf '1 \033> \n' >"${TSHDIR}/keys"
+	"$PTY" -k "${TSHDIR}/keys" -- "$PICK" -j 1 <"$STDIN" >"${TSHDIR}/want"
+	for _j in 2 3 4 7; do
+		pick -k "1 \\033> \\n" -- -j "$_j" <"${TSHDIR}/want"
+	done
+fi
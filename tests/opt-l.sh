@@ -0,0 +1,36 @@
+if testcase "scan budget favors the shortest match by default"; then
+	{ echo axxb ab; echo axb xxx; } >"$STDIN"
+	pick -k "ab \\n" <<-EOF
+	axxb ab
+	EOF
+fi
+
+if testcase "scan budget exhausted uses the shortest match found so far"; then
+	{ echo axxb ab; echo axb xxx; } >"$STDIN"
+	pick -k "ab \\n" -- -l 1 <<-EOF
+	axb xxx
+	EOF
+fi
+
+if testcase "scan budget on extremely long line"; then
+	{ head -c 1000000 /dev/zero | tr '\0' a; echo b; echo xab; } >"$STDIN"
+	pick -k "ab \\n" <<-EOF
+	xab
+	EOF
+fi
+
+if testcase "scan budget exhausted on extremely long line ranks it lower"; then
+	_c="a$(head -c 2000 /dev/zero | tr '\0' x)b"
+	{ printf a; head -c 1100000 /dev/zero | tr '\0' x; echo bab; } \
+		>"$STDIN"
+	echo "$_c" >>"$STDIN"
+	pick -k "ab \\n" <<-EOF
+	${_c}
+	EOF
+fi
+
+if testcase "scan budget invalid argument"; then
+	pick -e -- -l 0 <<-EOF
+	pick: scan budget too small: 0
+	EOF
+fi
@@ -0,0 +1,47 @@
+if testcase "bounded matches keeps the best match"; then
+	{ echo aaab; echo xab; echo ab; } >"$STDIN"
+	pick -k "ab \\n" -- -m 1 <<-EOF
+	ab
+	EOF
+fi
+
+if testcase "bounded matches limits the number of matches"; then
+	{ echo 1; echo 2; echo 3; echo 4; } >"$STDIN"
+	pick -k "\\033OF \\n" -- -m 2 <<-EOF
+	2
+	EOF
+fi
+
+if testcase "bounded matches with sorting disabled"; then
+	{ echo ab; echo aab; echo aaab; } >"$STDIN"
+	pick -k "b \\033OF \\n" -- -S -m 2 <<-EOF
+	aab
+	EOF
+fi
+
+if testcase "bounded matches with descriptions"; then
+	{ echo a b; echo aaab; } >"$STDIN"
+	pick -k "b \\n" -- -d -m 2 <<-EOF
+	aaab
+	EOF
+fi
+
+if testcase "bounded matches removing duplicates"; then
+	{ echo a; echo b; echo a; echo c; } >"$STDIN"
+	pick -k "\\033OF \\n" -- -u -m 3 <<-EOF
+	c
+	EOF
+fi
+
+if testcase "bounded matches removing duplicates keeping the last"; then
+	{ echo a; echo b; echo a; echo c; } >"$STDIN"
+	pick -k "\\033OB \\n" -- -U -m 3 <<-EOF
+	a
+	EOF
+fi
+
+if testcase "bounded matches invalid argument"; then
+	pick -e -- -m 0 <<-EOF
+	pick: max matches too small: 0
+	EOF
+fi
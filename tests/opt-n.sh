@@ -0,0 +1,54 @@
+if testcase "match a single field"; then
+	{ echo "a b"; echo "b a"; } >"$STDIN"
+	pick -k "b \\n" -- -n 2 <<-EOF
+	a b
+	EOF
+fi
+
+if testcase "match a range of fields"; then
+	{ echo "a b c"; echo "a c b"; echo "c a b"; } >"$STDIN"
+	pick -k "ab \\n" -- -n 1-2 <<-EOF
+	a b c
+	EOF
+fi
+
+if testcase "match an unbounded range of fields"; then
+	{ echo "a c b"; echo "c a b"; } >"$STDIN"
+	pick -k "ab \\n" -- -n 2- <<-EOF
+	c a b
+	EOF
+fi
+
+if testcase "consecutive separators are treated as one"; then
+	{ echo "  a   b"; echo "b a"; } >"$STDIN"
+	pick -k "b \\n" -- -n 2 <<-EOF
+	  a   b
+	EOF
+fi
+
+if testcase "choices missing the fields are not matched"; then
+	{ echo "a"; echo "b a"; } >"$STDIN"
+	pick -k "a \\n" -- -n 2 <<-EOF
+	b a
+	EOF
+fi
+
+if testcase "trailing separators are not part of the fields"; then
+	{ echo "x a "; echo "x a b"; } >"$STDIN"
+	pick -k "\\n" -- -n 2- -q "'a '" <<-EOF
+	x a b
+	EOF
+fi
+
+if testcase "fields with descriptions"; then
+	{ echo "a b c"; echo "b a c"; } >"$STDIN"
+	pick -k "b \\n" -- -d -n 1 <<-EOF
+	b a
+	EOF
+fi
+
+if testcase "invalid fields"; then
+	pick -e -- -n 2-1 <<-EOF
+	pick: fields too small: 2-1
+	EOF
+fi
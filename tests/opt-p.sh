@@ -0,0 +1,20 @@
+if testcase "preview does not affect the selection"; then
+	{ echo a; echo b; } >"$STDIN"
+	pick -k "\\033OB \\n" -- -p "'echo \"\$1\"'" <<-EOF
+	b
+	EOF
+fi
+
+if testcase "preview command is cancelled"; then
+	{ echo a; echo b; } >"$STDIN"
+	pick -k "\\033OB \\033OA \\n" -- -p "'sleep 60'" <<-EOF
+	a
+	EOF
+fi
+
+if testcase "preview command not found"; then
+	echo a >"$STDIN"
+	pick -k "\\n" -- -p 'pick-preview-not-found' <<-EOF
+	a
+	EOF
+fi
@@ -0,0 +1,47 @@
+if testcase "reload choices using the query"; then
+	pick -k "ab \\033OB \\n" -- -r "'seq 3 | sed s/^/\$1/'" <<-EOF
+	ab2
+	EOF
+fi
+
+if testcase "reload replaces the choices"; then
+	pick -k "\\033OB b \\033OB \\n" -- -q a -r "'seq 3 | sed s/^/\$1/'" <<-EOF
+	ab2
+	EOF
+fi
+
+if testcase "reload choices are not filtered"; then
+	pick -k "x \\n" -- -r "'echo a'" <<-EOF
+	a
+	EOF
+fi
+
+if testcase "reload choice without trailing newline"; then
+	pick -k "\\033OB \\n" -- -r "'echo a; printf b'" <<-EOF
+	b
+	EOF
+fi
+
+if testcase "reload with descriptions"; then
+	pick -k "\\n" -- -d -o -r "'echo a b'" <<-EOF
+	a
+	b
+	EOF
+fi
+
+if testcase "reload keys deferred while running can be interrupted"; then
+	pick -e -k "\\n ^C" -- -r "'sleep 60'" </dev/null
+fi
+
+if testcase "reload keys deferred are discarded once the query changes"; then
+	pick -k "\\n \\b \\b 0 \\n" -- -q 60 -r "'sleep \$1; echo x\$1'" \
+		<<-EOF
+	x0
+	EOF
+fi
+
+if testcase "reload keys deferred time out"; then
+	pick -k "\\n" -- -r "'echo a; sleep 60'" <<-EOF
+	a
+	EOF
+fi
@@ -4,3 +4,24 @@ if testcase "with sorting disabled"; then
 	ABC
 	EOF
 fi
+
+if testcase "with sorting disabled and matches below the visible choices"; then
+	seq 100 >"$STDIN"
+	pick -l 3 -k "1 \\033OB \\033OB \\033OB \\n" -- -S <<-EOF
+	12
+	EOF
+fi
+
+if testcase "with sorting disabled and page down below the visible choices"; then
+	seq 100 >"$STDIN"
+	pick -l 3 -k "1 \\033[6~ \\033[6~ \\n" -- -S <<-EOF
+	13
+	EOF
+fi
+
+if testcase "with sorting disabled and end below the visible choices"; then
+	seq 100 >"$STDIN"
+	pick -l 3 -k "1 \\033OF \\n" -- -S <<-EOF
+	100
+	EOF
+fi
@@ -0,0 +1,28 @@
+if testcase "keep first occurrence of duplicates"; then
+	{ echo a; echo b; echo a; } >"$STDIN"
+	pick -k "\\033OF \\n" -- -u <<-EOF
+	b
+	EOF
+fi
+
+if testcase "keep last occurrence of duplicates"; then
+	{ echo a; echo b; echo a; } >"$STDIN"
+	pick -k "\\033OF \\n" -- -U <<-EOF
+	a
+	EOF
+fi
+
+if testcase "duplicates are matched once"; then
+	{ echo ab; echo ab; echo ab; echo b; } >"$STDIN"
+	pick -k "b \\033OB \\n" -- -S -u <<-EOF
+	b
+	EOF
+fi
+
+if testcase "duplicates including descriptions"; then
+	{ echo a b; echo a c; echo a b; } >"$STDIN"
+	pick -k "\\033OF \\n" -- -d -o -u <<-EOF
+	a
+	c
+	EOF
+fi
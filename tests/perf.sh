@@ -0,0 +1,48 @@
+# Latency of each key measured from the moment it is written until the next
+# frame is drawn, failing if it exceeds the budget in milliseconds. The input
+# sizes can be adjusted using PERFLINES, i.e. make test PERFLINES=10000000.
+PERFBUDGET="${PERFBUDGET:-2000}"
+PERFLINES="${PERFLINES:-1000000}"
+
+# perfgen kind lines
+perfgen() {
+	awk -v kind="$1" -v n="$2" 'BEGIN {
+		for (i = 0; i < n; i++) {
+			if (kind == "ascii")
+				printf("dir%d/sub%d/file%d.c\n", i % 97, i % 1009, i)
+			else if (kind == "utf8")
+				printf("räk%d/smör%d/gås%d.ö\n", i % 97, i % 1009, i)
+			else
+				printf("\033[1;32mdir%d\033[0m/\033[34mfile%d\033[0m\n",
+				    i % 97, i)
+		}
+	}' >"$STDIN"
+}
+
+# Measuring latency is pointless while running under valgrind.
+[ -n "${EXEC:-}" ] && PERFLINES=""
+
+for _n in $PERFLINES; do
+	_i=$((_n - 1))
+
+	if testcase -t perf "ascii input of ${_n} lines"; then
+		perfgen ascii "$_n"
+		pick -b "$PERFBUDGET" -k "f i l e ${_i} . c \\n" <<-EOF
+		dir$((_i % 97))/sub$((_i % 1009))/file${_i}.c
+		EOF
+	fi
+
+	if testcase -t perf "utf-8 input of ${_n} lines"; then
+		perfgen utf8 "$_n"
+		pick -b "$PERFBUDGET" -k "g å s ${_i} . ö \\n" <<-EOF
+		räk$((_i % 97))/smör$((_i % 1009))/gås${_i}.ö
+		EOF
+	fi
+
+	if testcase -t perf "escape sequence input of ${_n} lines"; then
+		perfgen escape "$_n"
+		printf '\033[1;32mdir%d\033[0m/\033[34mfile%d\033[0m\n' \
+		    $((_i % 97)) "$_i" |
+		pick -b "$PERFBUDGET" -k "f i l e ${_i} \\n"
+	fi
+done
@@ -1,5 +1,6 @@
-# pick [-e] [-o] [-k keys] [-l lines] -- [pick-argument ...]
+# pick [-e] [-o] [-b budget] [-k keys] [-l lines] -- [pick-argument ...]
 pick() {
+	local _budget=""
 	local _env=""
 	local _exit1=0
 	local _exit2=0
@@ -10,6 +11,7 @@ pick() {
 
 	while [ "$#" -gt 0 ]; do
 		case "$1" in
+		-b)	shift; _budget="-b ${1}";;
 		-e)	_exit1=1;;
 		-k)	shift; printf "$1" >"$_keys";;
 		-l)	shift; _env="${_env} LINES=${1}";;
@@ -24,7 +26,7 @@ pick() {
 	[ -e "$_keys" ] || : >"$_keys"
 
 	# shellcheck disable=SC2086
-	env $_env "$PTY" -k "$_keys" -- $EXEC "$PICK" "$@" \
+	env $_env "$PTY" $_budget -k "$_keys" -- $EXEC "$PICK" "$@" \
 		<"$STDIN" >"$_out" 2>&1 || _exit2="$?"
 	if [ "$_exit1" -ne "$_exit2" ]; then
 		if [ "$_exit2" -gt 128 ]; then